@@ -9,6 +9,20 @@
 #define CONFIG_H_
 
 /* by Fabio - Definies da porta D para comunicao com o SD */
+#ifdef HW_PULSE
+/* HW_PULSE board: Timer0 forms READ PULSE on OC0B (PD5, shared with
+   LCD D7), so SD CLK moves to PD6 (shared with LCD D4) and ENTER to PC1 */
+#define _CLK_DI_CS	0b11010010
+#define _CLKNDI_CS	0b11000010
+#define NCLK_DI_CS	0b10010010
+#define NCLKNDI_CS	0b10000010
+#define _CLK_DINCS	0b11010000
+#define _CLKNDINCS	0b11000000
+#define NCLK_DINCS	0b10010000
+#define NCLKNDINCS	0b10000000
+#define ENTER_PIN	PINC
+#define ENTER_BIT	1
+#else
 #define _CLK_DI_CS	0b11110010
 #define _CLKNDI_CS	0b11100010
 #define NCLK_DI_CS	0b11010010
@@ -17,6 +31,27 @@
 #define _CLKNDINCS	0b11100000
 #define NCLK_DINCS	0b11010000
 #define NCLKNDINCS	0b11000000
+#define ENTER_PIN	PIND
+#define ENTER_BIT	6
+#endif
+
+/* HW_PULSE: Timer0 period (a 4 us bit cell) and the OCR0B that makes
+   a 1 us pulse at the end of it; OCR0B above the period makes none */
+#define PULSE_TOP	(F_CPU / 250000 - 1)
+#define PULSE_AT	(PULSE_TOP - F_CPU / 1000000 + 1)
+#define PULSE_NONE	0xff
+
+/* writeData (sdisk2.c): CAP_NUM fields captured by INT0, then a journal
+   of JRN_NUM decoded sectors; raw NIB and WOZ tracks, which are never
+   written, play from a ring in the journal (sub.S, prepare 4) */
+#define CAP_NUM		2
+#define CAP_SIZE	350
+#define JRN_NUM		3
+#define RAW_START	(CAP_NUM * CAP_SIZE)
+#define RAW_SIZE	(JRN_NUM * 256)
+
+/* free SRAM is painted with this at reset (sub.S), see stackFree() */
+#define STACK_PAINT	0xC5
 
 
 #endif /* CONFIG_H_ */
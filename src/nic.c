@@ -0,0 +1,234 @@
+/*------------------------------------
+
+	SDISK II LCD Firmware
+
+	NIC sector encoder, shared by the firmware (sdisk2.c)
+	and the host tools (../tools)
+
+------------------------------------*/
+
+/*
+This is a part of the firmware for DISK II emulator by Nishida Radio.
+
+Copyright (C) 2010 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "nic.h"
+
+// encode table for a nib image
+const unsigned char encTable[64] NIC_ROM = {
+	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
+	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
+	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
+	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
+	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
+	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
+	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
+	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+
+// decode table: 6-bit value of nibble (0x80 + i), 0xFF if not a valid nibble
+static const unsigned char decTable[128] NIC_ROM = {
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x00,0x01,
+	0xFF,0xFF,0x02,0x03,0xFF,0x04,0x05,0x06,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0x07,0x08,
+	0xFF,0xFF,0xFF,0x09,0x0A,0x0B,0x0C,0x0D,
+	0xFF,0xFF,0x0E,0x0F,0x10,0x11,0x12,0x13,
+	0xFF,0x14,0x15,0x16,0x17,0x18,0x19,0x1A,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0x1B,0xFF,0x1C,0x1D,0x1E,
+	0xFF,0xFF,0xFF,0x1F,0xFF,0xFF,0x20,0x21,
+	0xFF,0x22,0x23,0x24,0x25,0x26,0x27,0x28,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0x29,0x2A,0x2B,
+	0xFF,0x2C,0x2D,0x2E,0x2F,0x30,0x31,0x32,
+	0xFF,0xFF,0x33,0x34,0x35,0x36,0x37,0x38,
+	0xFF,0x39,0x3A,0x3B,0x3C,0x3D,0x3E,0x3F
+};
+
+// a table for translating logical sectors into physical sectors
+const unsigned char physicalSector[16] NIC_ROM = {
+		0,13,11,9,7,5,3,1,14,12,10,8,6,4,2,15};
+
+// ProDOS order: sector #n of a track in a PO image is this physical sector
+const unsigned char poPhysical[16] NIC_ROM = {
+		0,2,4,6,8,10,12,14,1,3,5,7,9,11,13,15};
+
+// for bit flip
+static const unsigned char FlipBit[4] NIC_ROM = { 0,  2,  1,  3  };
+static const unsigned char FlipBit1[4] NIC_ROM = { 0, 2,  1,  3  };
+static const unsigned char FlipBit2[4] NIC_ROM = { 0, 8,  4,  12 };
+static const unsigned char FlipBit3[4] NIC_ROM = { 0, 32, 16, 48 };
+
+/******************************************************************************/
+// the part of a NIC sector before its data field, but for the volume,
+// track and sector of its address field (nicAddress)
+void nicHead(unsigned char *dst)
+{
+	unsigned char i;
+
+	for (i = 0; i < 0x16; i++) dst[i] = 0xff;
+
+	// sync header
+	dst[0x16] = 0x03;
+	dst[0x17] = 0xfc;
+	dst[0x18] = 0xff;
+	dst[0x19] = 0x3f;
+	dst[0x1a] = 0xcf;
+	dst[0x1b] = 0xf3;
+	dst[0x1c] = 0xfc;
+	dst[0x1d] = 0xff;
+	dst[0x1e] = 0x3f;
+	dst[0x1f] = 0xcf;
+	dst[0x20] = 0xf3;
+	dst[0x21] = 0xfc;
+	
+	// address header
+	dst[0x22] = 0xd5;
+	dst[0x23] = 0xaa;
+	dst[0x24] = 0x96;
+	dst[0x2d] = 0xde;
+	dst[0x2e] = 0xaa;
+	dst[0x2f] = 0xeb;
+	
+	// sync header
+	for (i=0x30; i<0x35; i++) dst[i]=0xff;
+	
+	// data
+	dst[0x35] = 0xd5;
+	dst[0x36] = 0xaa;
+	dst[0x37] = 0xad;
+}
+
+/******************************************************************************/
+// NIC sector template
+void nicTemplate(unsigned char *dst)
+{
+	unsigned short i;
+
+	nicHead(dst);
+	dst[0x18f] = 0xde;
+	dst[0x190] = 0xaa;
+	dst[0x191] = 0xeb;
+	for (i = 0x192; i < 0x1a0; i++)
+		dst[i]=0xff;
+	for (i = 0x1a0; i < 0x200; i++)
+		dst[i]=0x00;
+}
+
+/******************************************************************************/
+// address field of a NIC sector
+void nicAddress(unsigned char *dst, unsigned char vol, unsigned char trk, unsigned char sec)
+{
+	unsigned char c;
+
+	dst[0x25] = ((vol >> 1) | 0xAA);
+	dst[0x26] = (vol | 0xAA);
+	dst[0x27] = ((trk >> 1) | 0xAA);
+	dst[0x28] = (trk | 0xAA);
+	dst[0x29] = ((sec >> 1) | 0xAA);
+	dst[0x2a] = (sec | 0xAA);
+	c = (vol ^ trk ^ sec);
+	dst[0x2b] = ((c >> 1) | 0xAA);
+	dst[0x2c] = (c | 0xAA);
+}
+
+/******************************************************************************/
+// the layout of a NIC image: sector #(n) of a DSK (or PO) image is
+// physical sector nicPlace(n) & 15 of track n / 16
+unsigned short nicPlace(unsigned short n, unsigned char order)
+{
+	return ((n & ~15) + nic_rd(((order == 'P') ? poPhysical : physicalSector) + (n & 15)));
+}
+
+#ifndef __AVR__
+/******************************************************************************/
+// a whole image at once, for the host tools (dsk2Nic converts on the
+// card sector by sector)
+void nicImage(unsigned char *dst, const unsigned char *src, unsigned char vol, unsigned char order)
+{
+	unsigned short n, k;
+	unsigned char *d;
+
+	for (n = 0; n < NIC_TRACKS * NIC_SECTORS; n++) {
+		k = nicPlace(n, order);
+		d = dst + (unsigned long)k * NIC_SECT_SIZE;
+		nicTemplate(d);
+		nicSector(d, src + (unsigned long)n * 256, vol, n >> 4, k & 15);
+	}
+}
+#endif
+
+/******************************************************************************/
+// address field and 6-and-2 encoded data field of a NIC sector
+void nicSector(unsigned char *dst, const unsigned char *src,
+	unsigned char vol, unsigned char trk, unsigned char sec)
+{
+	unsigned char ox = 0;
+	unsigned short i;
+
+	nicAddress(dst, vol, trk, sec);
+	for (i = 0; i < NIC_NIBBLES; i++)
+		dst[i + NIC_DATA] = nicNibble(src, i, &ox);
+}
+
+/******************************************************************************/
+// nibble #(i) of the 6-and-2 encoded data field
+unsigned char nicNibble(const unsigned char *src, unsigned short i, unsigned char *ox)
+{
+	unsigned char x, c;
+
+	if (i < 86)
+		x = (nic_rd(FlipBit1 + (src[i] & 3)) |
+			nic_rd(FlipBit2 + (src[i + 86] & 3)) |
+			((i <= 83) ? nic_rd(FlipBit3 + (src[i + 172] & 3)) : 0));
+	else if (i < 342)
+		x = (src[i - 86] >> 2);
+	else
+		return nic_rd(encTable + *ox);												// checksum
+	c = nic_rd(encTable + (x ^ *ox));
+	*ox = x;
+	return c;
+}
+
+/******************************************************************************/
+// decode the 343 nibbles of a data field (src, after D5 AA AD) into 256 bytes
+// (dst); the first 86 nibbles of src are overwritten with their 2-bit groups
+unsigned char nicDecode(unsigned char *dst, unsigned char *src)
+{
+	unsigned char x, ox = 0, ok = 1;
+	unsigned short i;
+
+	for (i = 0; i < NIC_NIBBLES; i++) {
+		x = ((src[i] & 0x80) ? nic_rd(decTable + (src[i] & 0x7f)) : 0xff);
+		if (x == 0xff) {															// Nibble invlido
+			ok = 0;
+			x = 0;
+		}
+		x ^= ox;
+		if (i < 86) src[i] = x;
+		else if (i < 342) dst[i - 86] = (x << 2);
+		else if (x) ok = 0;															// Checksum errado
+		ox = x;
+	}
+	for (i = 0; i < 256; i++) {
+		x = src[(i < 86) ? i : ((i < 172) ? (i - 86) : (i - 172))];
+		x >>= ((i < 86) ? 0 : ((i < 172) ? 2 : 4));
+		dst[i] |= nic_rd(FlipBit + (x & 3));
+	}
+	return ok;
+}
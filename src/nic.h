@@ -0,0 +1,86 @@
+/*------------------------------------
+
+	SDISK II LCD Firmware
+
+	NIC sector encoder, shared by the firmware (sdisk2.c)
+	and the host tools (../tools)
+
+------------------------------------*/
+
+/*
+This is a part of the firmware for DISK II emulator by Nishida Radio.
+
+Copyright (C) 2010 Koichi NISHIDA
+email to Koichi NISHIDA: tulip-house@msf.biglobe.ne.jp
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NIC_H
+#define NIC_H
+
+// a NIC image is 35 tracks of 16 sectors, 512 bytes per sector,
+// stored in physical sector order
+#define NIC_TRACKS		35
+#define NIC_SECTORS		16
+#define NIC_SECT_SIZE	512
+#define NIC_SIZE		((unsigned long)NIC_TRACKS * NIC_SECTORS * NIC_SECT_SIZE)
+#define DSK_SIZE		((unsigned long)NIC_TRACKS * NIC_SECTORS * 256)
+// a data field: D5 AA AD, 342 data nibbles and the checksum, DE AA EB
+#define NIC_NIBBLES		343
+// where they start in a NIC sector, after D5 AA AD
+#define NIC_DATA		0x38
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define NIC_ROM			PROGMEM
+#define nic_rd(p)		pgm_read_byte_near(p)
+#else
+#define NIC_ROM
+#define nic_rd(p)		(*(p))
+#endif
+
+// encode table for a nib image
+extern const unsigned char encTable[64] NIC_ROM;
+// a table for translating logical (DOS 3.3) sectors into physical sectors
+extern const unsigned char physicalSector[16] NIC_ROM;
+// the same for the sectors of a ProDOS ordered image
+extern const unsigned char poPhysical[16] NIC_ROM;
+
+// NIC sector (track * 16 + physical sector) of sector #(n) of a DOS
+// ('D') or ProDOS ('P') ordered image
+unsigned short nicPlace(unsigned short n, unsigned char order);
+#ifndef __AVR__
+// convert a whole DOS or ProDOS ordered image (src) into a NIC image (dst)
+void nicImage(unsigned char *dst, const unsigned char *src, unsigned char vol, unsigned char order);
+#endif
+
+// write the sync bytes, field prologues and epilogues into a 512-byte
+// NIC sector, the parts nicSector does not touch
+void nicTemplate(unsigned char *dst);
+// the same for the NIC_DATA bytes before the data field only
+void nicHead(unsigned char *dst);
+// write the address field of physical sector (sec) of track (trk)
+void nicAddress(unsigned char *dst, unsigned char vol, unsigned char trk, unsigned char sec);
+// encode 256 bytes (src) as physical sector (sec) of track (trk)
+// into a NIC sector prepared by nicTemplate
+void nicSector(unsigned char *dst, const unsigned char *src,
+	unsigned char vol, unsigned char trk, unsigned char sec);
+// nibble #(i) (0 - 342) of the data field of 256 bytes (src),
+// (*ox) is 0 before the first nibble
+unsigned char nicNibble(const unsigned char *src, unsigned short i, unsigned char *ox);
+// decode the 343 nibbles after D5 AA AD (src, overwritten) into 256 bytes,
+// return 0 if a nibble is invalid or the checksum is wrong
+unsigned char nicDecode(unsigned char *dst, unsigned char *src);
+
+#endif
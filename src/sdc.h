@@ -0,0 +1,46 @@
+/*------------------------------------
+
+	SDISK II LCD Firmware
+
+	SDC disk container, shared by the firmware (sdisk2.c)
+	and the host packer (../tools/mksdc.c)
+
+------------------------------------*/
+
+/*
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+*/
+
+#ifndef SDC_H
+#define SDC_H
+
+// an SDC file holds many disk images and must be contiguous on the card:
+// the firmware then reaches any of them without reading the FAT again.
+// It starts with an index of SDC_REC byte records, little endian:
+//   record 0       "SDC1", disk count (2 bytes), 10 bytes of 0
+//   record n       disk n (1 - count): name (8, space padded), type,
+//                  flags, block count (2), first block (4)
+// and every image starts on a 512-byte block after the index
+#define SDC_EXT			"SDC"
+#define SDC_MAGIC		"SDC1"
+#define SDC_REC			16
+#define SDC_MAX			4095	// disks, the index is 128 blocks at most
+
+// record fields
+#define SDC_NAME		0
+#define SDC_TYPE		8		// 0 NIC, 1 NIB, 2 WOZ (the firmware's IMG_ types)
+#define SDC_FLAGS		9
+#define SDC_BLOCKS		10
+#define SDC_FIRST		12
+#define SDC_COUNT		4		// in record 0
+
+#define SDC_READONLY	0x01	// flags: mount write protected
+
+#endif
@@ -51,6 +51,18 @@ pin		signal	description
 	
 	Note that the enable input of the 3state buffer 74HC125,
 	should be connected with DRIVE ENABLE.
+
+	SMARTPORT build: PHASE-0 is REQ, PHASE-1 and PHASE-3 enable the bus,
+	PHASE-0 with PHASE-2 resets it, WRITE / WRITE REQUEST carry the host
+	packets, READ PULSE the device packets and WRITE PROTECT is ACK.
+	The drive enables stay off on this bus, so the enable input of the
+	74HC125 must be tied low (always enabled) instead.
+
+	WRITE_ICP build: WRITE (C2, ADC2) is compared with the 1.1V bandgap
+	and the comparator output drives the Timer1 input capture.
+
+	HW_PULSE board: READ PULSE is Timer0 OC0B on D5 (with LCD D7, through
+	the 74HC125), SD CLK is on D6 (with LCD D4) and ENTER on C1.
 */
 
 /*
@@ -75,16 +87,129 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include <util/delay.h>
 #include "string.h"
 #include "config.h"
+#include "nic.h"
+#include "sdc.h"
+#ifdef TRACE
+#include "trace.h"
+#endif
 
 #define WAIT 1
-#define BUF_NUM 5
 #define FAT_DSK_ELEMS 18
 #define FAT_NIC_ELEMS 35
+#define IMG_NIC 0		// 16 blocks of 402 nibble bytes per track
+#define IMG_NIB 1		// 6656 raw nibble bytes (13 blocks) per track
+#define IMG_WOZ 2		// WOZ2 bitstream tracks, located through TMAP/TRKS
+#define IMG_PO 3		// ProDOS blocks (PO, HDV), SMARTPORT build
+#define IMG_2MG 4		// ProDOS blocks after a 2IMG header, SMARTPORT build
+#ifdef SMARTPORT
+#define IMG_EXTS "PO 2MGHDV"
+#else
+#define IMG_EXTS "NICNIBWOZSDC"
+#endif
+#define IMG_EXT_NUM ((sizeof(IMG_EXTS) - 1) / 3)
+#define LIST_MAX 144	// chooser list entries (10 bytes each, kept in writeData)
+#define DIR_FLAG 0x8000	// the chooser list entry is a directory
+#define SDC_FLAG 0x4000	// the chooser list entry is an SDC container
+
+// accelerated mode: NIC sectors start streaming here, after the 22 plain
+// FF bytes and the first 5 bytes of the sync header (about 5 self-sync
+// bytes are left before the address field, enough for DOS 3.3 and ProDOS)
+#define ACCEL_SKIP 0x1b
 #define nop() __asm__ __volatile__ ("nop")
 
+// record an event of the SD access trace (TRACE build only)
+#ifdef TRACE
+#define TRC(t, a, b) trcEvent(t, a, b)
+#define TRC_RING 64		// records are kept here until the drive is disabled
+#else
+#define TRC(t, a, b)
+#endif
+
+// WRITE_ICP build: writes are decoded from Timer1 input capture time
+// stamps (sub.S), Timer1 runs at F_CPU and cannot stamp the trace
+#if defined(WRITE_ICP) && defined(TRACE)
+#error "WRITE_ICP and TRACE both need Timer1"
+#endif
+// HW_PULSE board: the SmartPort packets are still sent on C1
+#if defined(HW_PULSE) && defined(SMARTPORT)
+#error "HW_PULSE has no SMARTPORT build"
+#endif
+
+// SD card budgets, counted in bytes read (about 5 us each at 25MHz),
+// so that no card wait can freeze the emulator
+#define SD_RESP_WAIT 16			// command response (Ncr is 8 at most)
+#define SD_READ_WAIT 2000		// data token, about 10 ms (a NIC sector is 12.9 ms)
+#define SD_BUSY_WAIT 50000		// write busy, about 250 ms
+#define SD_INIT_WAIT 2000		// ACMD41 tries while initializing
+#define SD_RETRY 3				// command re-issues on an error or a missed deadline
+#define SD_MAX_ERRORS 16		// failed sector reads in a row before mounting again
+// the card was removed: set by INT1, or still pending in EIFR while the
+// interrupts are off (mounting and converting run under cli)
+#define SD_ABORT (sdAbort || bit_is_set(EIFR, INTF1))
+
+#ifdef SMARTPORT
+// SmartPort bus: the packets and the block being served share writeData
+#define SP_BUF (writeData)					// packet sent or received
+#define SP_MAX 700							// a 512-byte data packet is 604 bytes
+#define SP_BLK (writeData + 856)			// block data (SP_BUF + 512 is writeSD's)
+#define SP_WAIT 200000UL					// handshake waits, about 100 ms
+#define SP_REQ bit_is_set(PINB, 0)			// PHASE-0
+#define SP_BUS ((PINB & 0b00001010) == 0b00001010)	// PHASE-1 and PHASE-3
+#define SP_RESET ((PINB & 0b00000101) == 0b00000101)	// PHASE-0 and PHASE-2
+#define SP_ACK_HI PORTC |= _BV(3)			// ready
+#define SP_ACK_LO PORTC &= ~_BV(3)			// packet taken
+// packet types and commands
+#define SP_PKT_CMD 0
+#define SP_PKT_STATUS 1
+#define SP_PKT_DATA 2
+#define SP_STATUS 0x00
+#define SP_READBLOCK 0x01
+#define SP_WRITEBLOCK 0x02
+#define SP_FORMAT 0x03
+#define SP_CONTROL 0x04
+#define SP_INIT 0x05
+// errors
+#define SP_BADCMD 0x01
+#define SP_BADCTL 0x21
+#define SP_IOERROR 0x27
+#define SP_NOWRITE 0x2b
+#define SP_BADBLOCK 0x2d
+#endif
+
+// buttons and card detect, sampled on a 10 ms Timer2 tick into debounced
+// states (keys) and press events (KEY_CARD: the card was inserted)
+#define TICK_HZ 100
+#define KEY_CARD 0x01			// PD3 low: card inserted
+#define KEY_ENTER 0x02			// PD6 low
+#define KEY_DOWN 0x04			// PD7 low
+#define KEY_UP 0x08				// PB5 low
+#define KEY_DEBOUNCE 3			// ticks the inputs must be stable
+#define KEY_REPEAT_DELAY 40		// UP / DOWN held: first repeat after 400 ms,
+#define KEY_REPEAT_RATE 8		// then every 80 ms
+#define INIT_RETRY 30			// ticks between mount attempts
+
+// an entry of the chooser list: the name is cached so that browsing
+// a directory reads its sectors only once
+struct dirItem {
+	unsigned short ent;		// entry index in the current directory, | DIR_FLAG or SDC_FLAG
+	char name[8];
+};
+
+// the BTF file in the root names the image mounted last, the record at
+// the start of its data tells where it is, and which disk of an SDC
+// container; a BTF without data (the original firmware makes one) or
+// without the record is the root
+#define BTF_MAGIC "BTF1"
+struct btfRec {
+	char magic[4];
+	unsigned short dir;		// first cluster of the directory, 0 for the root
+	unsigned short disk;	// disk of an SDC container, 0 for a plain file
+};
+
 // C prototypes
 
 // cancel read
@@ -96,46 +221,137 @@ void writeByteFast(unsigned char c);
 unsigned char readByteSlow(void);
 unsigned char readByteFast(void);
 // wait until finish a command
-void waitFinish(void);
+unsigned char waitFinish(void);
 // issue SD card command slowly without getting response
 void cmd_(unsigned char cmd, unsigned long adr);
 // issue SD card command fast and wait normal response
-void cmdFast(unsigned char cmd, unsigned long adr);
+unsigned char cmdFast(unsigned char cmd, unsigned long adr);
 // get command response slowly from the SD card
 unsigned char getRespSlow(void);
 // get command response fast from the SD card
 unsigned char getRespFast(void);
 // issue command 17 and get ready for reading
-void cmd17Fast(unsigned long adr);
+unsigned char cmd17Fast(unsigned long adr);
 // display a string to LCD
 void dispStr(char *str, unsigned char f);
-// get a file name from a directory entry
-void getFileName(unsigned short dir, char *name);
+// read a 16-bit word from the SD card
+unsigned short readWord(unsigned long adr);
+// change the current directory
+void setDir(unsigned short cluster);
+// SD card address of an entry of the current directory
+unsigned long dirAddr(unsigned short i);
+// read the current directory entry by entry
+unsigned char readDirNext(unsigned short i, unsigned char *ent);
+void skipDir(unsigned short i);
 // find a file whose extension is targExt,
 // and whose name is targName if withName is true
 int findExt(char *targExt, unsigned char *protect,
 	char *targName, unsigned char withName);
 // prepare the FAT table on memory
-void prepareFat(int i, unsigned short *fat, unsigned short len,
-	unsigned char fatNum, unsigned char fatElemNum);
+void prepareFat(unsigned long ent, unsigned short *fat, unsigned short len,
+	unsigned short fatNum, unsigned char fatElemNum);
+// SD card address of a block of the mounted image
+unsigned long imageAddr(unsigned short blk);
+// read the size of the mounted image and check its header
+unsigned char openImage(void);
+// whether the sectors of a track of the mounted NIC image can stream their data field only
+void nicFieldCheck(unsigned char trk);
+// SDC containers: read an index record, take the disk of the mounted
+// one, choose a disk of one, switch to another disk of the mounted one
+unsigned char sdcRead(unsigned short cluster, unsigned short n, unsigned char *buf, unsigned char len);
+unsigned char sdcSelect(void);
+unsigned short sdcChoose(unsigned short cluster, unsigned short cur);
+unsigned char sdcSwitch(void);
+// look up a WOZ track in TMAP and TRKS
+unsigned char loadWozTrack(unsigned char qtrk);
+// raw NIB and WOZ tracks: start playing from the ring, put the next
+// chunk of the track in it, keep it ahead while playing
+unsigned char rawStart(unsigned char trk);
+unsigned char rawFillRing(void);
+void rawKeep(void);
+unsigned char readByteRaw(void);
 // memory copy	
 void memcp(unsigned char *dst, unsigned char *src, const unsigned short len);
-// duplicate FAT for FAT16
-void duplicateFat(void);
+// write a 512-byte block to the SD card
+void writeBlock(unsigned long adr, unsigned char *buf);
+// send a 512-byte block to the SD card, leaving it programming
+void writeStart(unsigned long adr, unsigned char *buf);
 // write to the SD cart one by one
-void writeSD(unsigned long adr, unsigned char *data, unsigned short len);
+unsigned char writeSD(unsigned long adr, unsigned char *data, unsigned short len);
+// read / write a FAT entry through the FAT sector buffer
+unsigned short readFat(unsigned short cluster);
+void writeFat(unsigned short cluster, unsigned short val);
+// write the buffered FAT sector to both FATs if it was modified
+void flushFat(void);
+// find a free cluster run of (need) clusters, or the longest one
+unsigned short freeRun(unsigned short need, unsigned short *len);
 // create a NIC image file
 int createFile(char *name, char *ext, unsigned short sectNum);
+// remove the file of a directory entry
+void removeFile(unsigned long adr);
+// give the current subdirectory one more cluster of entries
+unsigned char dirExtend(unsigned short i);
 // translate a DSK image into a NIC image
-void dsk2Nic(void);
-// make file name list
-unsigned short makeFileNameList(unsigned short *list, char *targExt);
+unsigned char dsk2Nic(void);
+// make the file name list of the current directory
+unsigned short makeFileNameList(struct dirItem *list, char *targExt, unsigned char extNum);
 // choose a NIC file from a NIC file name list
 unsigned char chooseANicFile(void *tempBuff, unsigned char btfExists, char *filebase);
+// read the card identification register
+unsigned char readCid(unsigned char *cid);
+// read a 32-byte directory entry
+unsigned char readDirEntry(unsigned long adr, unsigned char *ent);
+// mount the last image again from the EEPROM cache
+unsigned char loadMount(unsigned char *cid, char *filebase);
+// save the mounted image to the EEPROM cache
+void saveMount(unsigned char *cid, char *filebase);
+// read and write the record in the data of the BTF file
+unsigned long btfData(void);
+unsigned char btfRead(struct btfRec *b);
+unsigned char btfWrite(struct btfRec *b);
+// read the volume and find (or convert, or choose) the image to mount
+unsigned char mountImage(unsigned char choose, char *filebase);
 // initialization called from check_eject
 void init(unsigned char choose);
 // called when the SD card is inserted or removed
 void check_eject(void);
+// buttons and card detect: sample on the tick, take the press events
+void inputInit(void);
+void inputPoll(void);
+unsigned char inputEvents(void);
+// switch the accelerated mode of the mounted image
+void toggleAccel(void);
+// mount an image of the MRU table
+void useMru(unsigned char k);
+// check an MRU slot against its directory entry, drop a slot
+unsigned char mruValid(unsigned char k);
+void mruDrop(unsigned char k);
+// swap to the next older or newer image of the MRU table
+void swapImage(unsigned char older);
+// show the mounted image name (and the accelerated mode)
+void dispImage(char *name);
+// SRAM diagnostics: smallest free stack since reset, LCD screen
+unsigned short stackFree(void);
+void showSram(void);
+#ifdef TRACE
+// SD access trace: open the trace file, record an event, write the records
+void trcOpen(void);
+void trcEvent(unsigned char type, unsigned char a, unsigned char b);
+void trcFlush(void);
+#endif
+#ifdef SMARTPORT
+// SmartPort: block count of the mounted image, handshakes, packets,
+// block access and the command loop
+unsigned char spOpen(void);
+unsigned char spWait(volatile unsigned char *pin, unsigned char mask, unsigned char val);
+unsigned short spReceive(void);
+void spReply(unsigned short len);
+unsigned short spEncode(unsigned char type, unsigned char stat, unsigned char *data, unsigned short len);
+unsigned short spDecode(unsigned char *dst, unsigned short max, unsigned short n);
+unsigned char spReadBlock(unsigned long blk);
+unsigned char spWriteBlock(unsigned long blk);
+void spLoop(void);
+#endif
 // buffer clear
 void buffClear(void);
 // Low-level LCD transfer 4 bits
@@ -160,14 +376,26 @@ void lcd_gotoxy(unsigned char x, unsigned char y);
 void lcd_puts(const char *str);
 // output a PROGMEM string on LCD
 void lcd_puts_p(prog_char *progmem_s);
+// output a 4 digit decimal number on LCD
+void lcd_dec(unsigned short n);
 
 // assembler functions
 // see sub.S file
 void wait5(unsigned short time);
+#ifdef SMARTPORT
+void spSend(unsigned char *buf, unsigned short len);
+unsigned short spRecv(unsigned char *buf, unsigned short max);
+#endif
 
 // write data back to a NIC image
 void writeBack(void);
 void writeBackSub(void);
+void writeBackOne(void);
+void journalOne(unsigned char c);
+// the card already holds the data field of capture slot #(c)
+unsigned char sameOnCard(unsigned char c);
+void journal(void);
+unsigned char capQueued(void);
 void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track);
 
 // SD card information
@@ -177,54 +405,139 @@ unsigned long fatAddr;					// the beginning of FAT
 unsigned char sectorsPerCluster, sectorsPerCluster2;	// sectors per cluster
 unsigned short sectorsPerFat;	
 unsigned long userAddr;					// the beginning of user data
+unsigned short clusterEnd;				// the clusters of the volume end before it
 // unsigned short fatDsk[FAT_DSK_ELEMS];// use writeData instead
 unsigned short fatNic[FAT_NIC_ELEMS];
-unsigned char prevFatNumDsk, prevFatNumNic;
-unsigned short nicDir, dskDir, btfDir;
+// a directory entry read by findExt, makeFileNameList, chooseANicFile,
+// createFile, mruValid or saveMount, none of which calls another: one
+// buffer instead of 32 bytes of each stack frame on the mount chain
+unsigned char dirEnt[32];
+unsigned char prevFatNumDsk;
+unsigned short prevFatNumNic;
+unsigned long nicEnt, dskEnt, btfEnt;	// directory entries (SD card addresses)
+unsigned short curDir;					// first cluster of the current directory, 0 for the root
+unsigned short dirCluster, dirFirst;	// a cluster of it and its first entry, 0xffff if none
+unsigned short fatBufSector;			// FAT sector in fatBuf, 0xffff if none
+unsigned char fatBufDirty;				// fatBuf was modified
+unsigned char imageType;				// IMG_NIC, IMG_NIB, IMG_WOZ, IMG_PO or IMG_2MG
+unsigned short imageClusters;			// clusters in the mounted image
+unsigned short imageStart;				// its first cluster
+unsigned char imageContig;				// its clusters are contiguous
+unsigned short sdcDisk;					// its disk in an SDC container (1 - count), 0 for a plain file
+unsigned long imageBase;				// the first block of that disk
+unsigned char wozTrack;					// quarter track of the loaded TRK entry
+unsigned short wozStart, wozBlocks;		// its first block and block count
+unsigned long wozBits;					// its bit count
+unsigned char rawByte;					// bits of the ring byte left to play, then a 1 (sub.S)
+unsigned char *rawPtr;					// next ring byte to play
+unsigned char *rawStop;					// the ring is filled up to here
+unsigned short rawSrc;					// next byte of the track to put in the ring
+unsigned char rawTrk;					// track played
+unsigned char rawCarry, rawShift;		// bits not put yet (a WOZ track ends within a byte)
+#ifdef SMARTPORT
+unsigned char spUnit;					// SmartPort ID given by INIT, 0 if none
+unsigned long spOffset;					// image offset of block 0
+unsigned short spBlocks;				// block count of the image
+#endif
 
 // DISK II status
-unsigned char ph_track;					// 0 - 139
+volatile unsigned char ph_track;		// 0 - 139
+volatile unsigned char headTrk;			// 0 - 34, the track the head is on or stepping onto
+volatile unsigned char trackChanged;	// set by the stepper interrupt
+unsigned char oldStp;					// last stepper phase input
 unsigned char sector;					// 0 - 15
-unsigned short bitbyte;					// 0 - (8*512-1)
-unsigned char prepare;
+unsigned short bitbyte;					// 0 - (8*514), 8*514 when no read is open
+unsigned short bitLimit;				// bits streamed from the current block
+unsigned char prepare;					// 1: preparing the next block, 2: sync filler, 3: headBuf, 4: raw ring
+unsigned char fillBit;					// bit of the sync filler byte, see sub.S
+unsigned char sdErrors;					// failed sector reads in a row
 unsigned char readPulse;
 unsigned char inited;
 unsigned char magState;
 unsigned char protect;
 unsigned char formatting;
+unsigned char accel;					// accelerated mode (NIC only)
+unsigned char fieldOnly;				// NIC sectors stream only their data field from the card
+unsigned char fieldTrk;					// track fieldOnly is for, 0xff if none
+unsigned char partRead;					// the block length is that of a data field read
+unsigned char headBuf[NIC_DATA];		// the NIC sector before its data field, played by sub.S
+unsigned char *headPtr;					// next byte of headBuf to play
+unsigned char headMask, headLeft;		// its bit, bytes left
+unsigned char keys;						// debounced KEY_ states
+unsigned char keyEvents;				// presses not taken yet
+unsigned char keyRaw, keyCount;			// last sample and ticks it has been stable
+unsigned char keyRepeat;				// ticks to the next UP / DOWN repeat
+unsigned char ticks;					// Timer2 ticks
+volatile unsigned char sdAbort;			// set by INT1 when the card is removed
 const unsigned char volume = 0xfe;
 
+// the last mounts, cached in EEPROM and keyed by the card CID: the volume,
+// then a table of the MRU_NUM most recently mounted images; at power on
+// the mounted one is checked against the start cluster, name, attribute
+// and size of its directory entry, and so is the one UP / DOWN swap to
+#define MOUNT_VALID 0xAA
+#define MRU_NUM 4
+struct mountCache {
+	unsigned char valid;
+	unsigned char cid[16];
+	unsigned long fatAddr, rootAddr, userAddr;
+	unsigned char sectorsPerCluster, sectorsPerCluster2;
+	unsigned short sectorsPerFat;
+	unsigned char cur;						// MRU slot of the mounted image
+	unsigned short clusterEnd;
+};
+struct mruEntry {
+	unsigned long ent;						// directory entry of the image
+	unsigned short cluster;					// its start cluster
+	unsigned char attr;						// its attribute
+	unsigned long size;						// its size
+	char name[8];
+	unsigned char type;
+	unsigned short clusters;
+	unsigned char protect;
+	unsigned char contig;					// imageContig
+	unsigned char accel;					// accelerated mode of this image
+	unsigned short disk;					// sdcDisk
+	unsigned long base;						// imageBase
+	unsigned char age;						// 0 for the newest, 0xff if the slot is empty
+};
+struct mountCache EEMEM eeMount;
+struct mruEntry EEMEM eeMru[MRU_NUM];
+unsigned short EEMEM eeMruFat[MRU_NUM][FAT_NIC_ELEMS];	// first window of each cluster map
+struct mruEntry mru[MRU_NUM];			// copy of eeMru
+unsigned char mruCur;					// MRU slot of the mounted image
+
 // write data buffer
-unsigned char writeData[BUF_NUM][350];
-unsigned char sectors[BUF_NUM], tracks[BUF_NUM];
-unsigned char buffNum;
+// CAP_NUM raw captures, then a journal of JRN_NUM decoded sectors;
+// also the scratch buffer while mounting and converting
+unsigned char writeData[CAP_NUM * CAP_SIZE + JRN_NUM * 256];
+#define capBuf(i) (&writeData[(unsigned short)(i) * CAP_SIZE])
+#define jrnBuf(i) (&writeData[CAP_NUM * CAP_SIZE + (unsigned short)(i) * 256])
+#define rawRing (writeData + RAW_START)
+#define RAW_CHUNK 256					// track bytes read into the ring at a time
+#define fatBuf (writeData + 512)		// FAT sector buffer while creating a file
+unsigned char capSec[CAP_NUM], capTrk[CAP_NUM];	// captured field, 0xff if none
+unsigned char sectors[JRN_NUM], tracks[JRN_NUM];	// journal sector and track
+unsigned char jrnBad[JRN_NUM];			// captured with a bad nibble or checksum
+unsigned char buffNum;					// capture slot INT0 captures into
+unsigned char wTail, wCount;			// journal: oldest slot, slots queued
 unsigned char *writePtr;
 
+#ifdef TRACE
+// SD access trace
+unsigned char trcBuf[TRC_RING];			// records not written yet
+unsigned char trcCount;					// bytes in trcBuf
+unsigned char trcLost;					// records lost while trcBuf was full
+unsigned char trcStream;				// sectors streamed since the last record
+unsigned char trcTrk;					// last traced track
+unsigned char trcIdle;					// TRC_IDLE recorded for this idle time
+unsigned long trcAddr;					// SD card address of SDISK2.TRC, 0 if none
+unsigned long trcPos, trcSize;			// write position and size of SDISK2.TRC
+#endif
+
 // a table for head stepper moter movement 
 PROGMEM prog_uchar stepper_table[4] = {0x0f,0xed,0x03,0x21};
 
-// encode / decode table for a nib image
-PROGMEM prog_uchar encTable[] = {
-	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
-	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
-	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
-	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
-	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
-	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
-	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
-	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
-};
-
-// a table for translating logical sectors into physical sectors
-PROGMEM prog_uchar physicalSector[] = {
-		0,13,11,9,7,5,3,1,14,12,10,8,6,4,2,15};
-
-// for bit flip
-PROGMEM prog_uchar FlipBit[] = { 0,  2,  1,  3  };
-PROGMEM prog_uchar FlipBit1[] = { 0, 2,  1,  3  };
-PROGMEM prog_uchar FlipBit2[] = { 0, 8,  4,  12 };
-PROGMEM prog_uchar FlipBit3[] = { 0, 32, 16, 48 };
-
 /* Mensagens */
 /*                     1234567890123456 */
 PROGMEM char MSG1[] = "   SDISK2 LCD   ";
@@ -235,7 +548,30 @@ PROGMEM char MSG5[] = "Load   Directory";
 PROGMEM char MSG6[] = "Select a Disk : ";
 PROGMEM char MSG7[] = "Loading ........";
 PROGMEM char MSG8[] = "   No SD Card   ";
-
+PROGMEM char MSG9[] = "   Fast  mode   ";
+PROGMEM char MSG10[]= "  Normal  mode  ";
+PROGMEM char MSG11[]= " Dir  : ";
+PROGMEM char MSG12[]= "RAM  used:      ";
+PROGMEM char MSG13[]= "Stack free:     ";
+PROGMEM char MSG14[]= " SDC  : ";
+PROGMEM char MSG15[]= "No room for NIC ";
+PROGMEM char MSG16[]= "Convert failed  ";
+
+
+#ifdef SMARTPORT
+/* the phases are the SmartPort bus: no Disk II interrupts */
+#define DISK_INT_ON					{ __asm__ __volatile__ ("" ::: "memory"); }
+#define DISK_INT_OFF				{ __asm__ __volatile__ ("" ::: "memory"); }
+#else
+/* Disk II interrupts: read pulse (Timer0) and write capture (INT0) */
+#define DISK_INT_ON					{ __asm__ __volatile__ ("" ::: "memory"); TIMSK0 |= (1<<TOIE0); EIMSK |= (1<<INT0); }
+#ifdef HW_PULSE
+/* and no more pulses from OC0B */
+#define DISK_INT_OFF				{ TIMSK0 &= ~(1<<TOIE0); EIMSK &= ~(1<<INT0); OCR0B = PULSE_NONE; __asm__ __volatile__ ("" ::: "memory"); }
+#else
+#define DISK_INT_OFF				{ TIMSK0 &= ~(1<<TOIE0); EIMSK &= ~(1<<INT0); __asm__ __volatile__ ("" ::: "memory"); }
+#endif
+#endif
 
 /* Definies para o LCD */
 #define LCD_ENABLE  				PORTC |= _BV(5)
@@ -248,7 +584,12 @@ PROGMEM char MSG8[] = "   No SD Card   ";
 void lcd_port(unsigned char c)
 {
 	LCD_DISABLE;
+#ifdef HW_PULSE
+	TCCR0A &= ~((1<<COM0B1) | (1<<COM0B0));		// PD5 is LCD D7 for now
+	if (c & 0x01) PORTD |= _BV(6); else PORTD &=~_BV(6);
+#else
 	if (c & 0x01) PORTC |= _BV(1); else PORTC &=~_BV(1);
+#endif
 	if (c & 0x02) PORTC |= _BV(3); else PORTC &=~_BV(3);
 	if (c & 0x04) PORTD |= _BV(4); else PORTD &=~_BV(4);
 	if (c & 0x08) PORTD |= _BV(5); else PORTD &=~_BV(5);
@@ -256,6 +597,9 @@ void lcd_port(unsigned char c)
 	_delay_us(1);
 	LCD_DISABLE;
 	_delay_us(1);
+#ifdef HW_PULSE
+	TCCR0A |= (1<<COM0B1) | (1<<COM0B0);		// READ PULSE again
+#endif
 }
 
 // ------------------------------------
@@ -326,6 +670,14 @@ void lcd_char(unsigned char c)
 	lcd_data(c);
 }
 
+// output a 4 digit decimal number on LCD
+void lcd_dec(unsigned short n)
+{
+	unsigned short d;
+
+	for (d = 1000; d; d /= 10) lcd_char('0' + (n / d) % 10);
+}
+
 /******************************************************************************/
 void lcd_puts(const char *str) {
 	register char c;
@@ -344,7 +696,7 @@ void lcd_puts_p(prog_char *progmem_s) {
 
 }
 /******************************************************************************/
-// display a 8-byte string to LCD
+// display a 8-byte string to LCD (f: 0 mounted, 1 disk, 2 directory, 3 container)
 void dispStr(char *str, unsigned char f)
 {
 	unsigned char i;
@@ -354,7 +706,7 @@ void dispStr(char *str, unsigned char f)
 		lcd_puts_p(MSG3);
 	} else {
 		lcd_gotoxy(0, 1);	// Linha 2, coluna 1
-		lcd_puts_p(MSG4);
+		lcd_puts_p((f == 2) ? MSG11 : ((f == 3) ? MSG14 : MSG4));	// 2: diretrio, 3: continer
 	}
 	for (i = 0; i != 8; i++)
 		lcd_char(*(str++));
@@ -368,26 +720,34 @@ void buffClear(void)
 	unsigned char i;
 	unsigned short j;
 	
-	for (i=0; i<BUF_NUM; i++)
-		for (j=0; j<350; j++)
-			writeData[i][j]=0;
-	for (i=0; i<BUF_NUM; i++)
+	for (j=0; j<sizeof(writeData); j++)
+		writeData[j]=0;
+	for (i=0; i<CAP_NUM; i++)
+		capSec[i]=capTrk[i]=0xff;
+	for (i=0; i<JRN_NUM; i++)
 		sectors[i]=tracks[i]=0xff;
+	wTail = wCount = 0;
+	buffNum = 0;
+	writePtr = capBuf(buffNum);
 }
 
 /******************************************************************************/
-// cancel read from the SD card
+// cancel read from the SD card, and set the block length back to 512
+// after a data field read
 void cancelRead(void)
 {
 	unsigned short i;
-	if (bitbyte < (402 * 8)) {
+	if (bitbyte < (514 * 8)) {
 		PORTD = NCLK_DINCS;
 		for (i = bitbyte; i < (514 * 8); i++) {		// 512 bytes + 2 CRC
-			if (bit_is_set(PIND, 3)) return;
 			PORTD = _CLK_DINCS;
 			PORTD = NCLK_DINCS;
 		}
-		bitbyte = 402 * 8;
+		bitbyte = 514 * 8;
+	}
+	if (partRead) {
+		partRead = 0;
+		cmdFast(16, (unsigned long)512);
 	}
 }
 
@@ -463,14 +823,29 @@ unsigned char readByteFast(void)
 }
 
 /******************************************************************************/
-// wait until data is written to the SD card
-void waitFinish(void)
+// the same, unrolled: the raw ring is filled in the time sub.S leaves
+#define RAW_IN(c) { PORTD = _CLK_DINCS; c = ((c << 1) | (PIND & 1)); PORTD = NCLK_DINCS; }
+unsigned char readByteRaw(void)
+{
+	unsigned char c = 0;
+
+	PORTD = NCLK_DINCS;
+	RAW_IN(c); RAW_IN(c); RAW_IN(c); RAW_IN(c);
+	RAW_IN(c); RAW_IN(c); RAW_IN(c); RAW_IN(c);
+	return c;
+}
+
+/******************************************************************************/
+// wait until data is written to the SD card, 0 if it is still busy
+unsigned char waitFinish(void)
 {
 	unsigned char ch;
+	unsigned short n = SD_BUSY_WAIT;
+
 	do {
-		ch = readByteFast();
-		if (bit_is_set(PIND, 3)) return;
-	} while (ch != 0xff);
+		ch = readByteFast();		// no card reads 0xff
+	} while ((ch != 0xff) && --n);
+	return (ch == 0xff);
 }
 
 /******************************************************************************/
@@ -488,10 +863,11 @@ void cmd_(unsigned char cmd, unsigned long adr)
 }
 
 /******************************************************************************/
-// issue a SD card command and wait normal response
-void cmdFast(unsigned char cmd, unsigned long adr)
+// issue a SD card command and wait normal response,
+// re-issued up to SD_RETRY times; returns the last response
+unsigned char cmdFast(unsigned char cmd, unsigned long adr)
 {
-	unsigned char res;
+	unsigned char res, n = SD_RETRY;
 	do {
 		writeByteFast(0xff);
 		writeByteFast(0x40 + cmd);
@@ -501,125 +877,180 @@ void cmdFast(unsigned char cmd, unsigned long adr)
 		writeByteFast(adr & 0xff);
 		writeByteFast(0x95);
 		writeByteFast(0xff);
-	} while (((res=getRespFast()) != 0) && (res != 0xff));
+		res = getRespFast();
+		if (SD_ABORT) break;
+	} while ((res != 0) && --n);
+	return res;
 }
 
 /******************************************************************************/
-// get a command response slowly from the SD card
+// get a command response slowly from the SD card, 0xff if none
 unsigned char getRespSlow(void)
 {
-	unsigned char ch;
+	unsigned char ch, n = SD_RESP_WAIT;
 	do {
 		ch = readByteSlow();
-		if (bit_is_set(PIND, 3)) return 0xff;
-	} while ((ch & 0x80) != 0);
+	} while (((ch & 0x80) != 0) && --n);
 	return ch;
 }
 
 /******************************************************************************/
-// get a command response fast from the SD card
+// get a command response fast from the SD card, 0xff if none
 unsigned char getRespFast(void)
 {
-	unsigned char ch;
+	unsigned char ch, n = SD_RESP_WAIT;
 	do {
 		ch = readByteFast();
-		if (bit_is_set(PIND, 3)) return 0xff;
-	} while ((ch & 0x80) != 0);
+	} while (((ch & 0x80) != 0) && --n);
 	return ch;
 }
 
 /******************************************************************************/
-// issue command 17 and get ready for reading
-void cmd17Fast(unsigned long adr)
+// issue command 17 and get ready for reading; an error token or a
+// missed deadline re-issues the command, 0 if all tries failed
+unsigned char cmd17Fast(unsigned long adr)
 {
-	unsigned char ch;
-
-	cmdFast(17, adr);
-	do {	
-		ch = readByteFast();
-		if (bit_is_set(PIND, 3)) return;
-	} while (ch != 0xfe);
+	unsigned char ch, n;
+	unsigned short w;
+
+	for (n = SD_RETRY; n; n--) {
+		if (SD_ABORT || (cmdFast(17, adr) != 0)) return 0;
+		w = SD_READ_WAIT;
+		do {
+			ch = readByteFast();
+		} while ((ch == 0xff) && --w);
+		if (ch == 0xfe) return 1;
+	}
+	return 0;
 }
 
 /******************************************************************************/
-// get a file name from a directory entry
-void getFileName(unsigned short dir, char *name)
+// read a 16-bit little-endian word, the block length must be 2; 0xffff
+// (the end of a cluster chain) if the card did not answer
+unsigned short readWord(unsigned long adr)
 {
-	unsigned char i;
+	unsigned short w;
 
-	cmdFast(16, 8);
-	cmd17Fast(rootAddr + dir * 32);
-	for (i = 0; i != 8; i++) *(name++) = (char)readByteFast();
+	if (!cmd17Fast(adr)) return 0xffff;
+	w = readByteFast();
+	w += (unsigned short)readByteFast() * 0x100;
 	readByteFast(); readByteFast(); // discard CRC bytes
+	return w;
 }
 
 /******************************************************************************/
-// find a file whose extension is targExt,
+// change the current directory, (cluster) 0 is the root
+void setDir(unsigned short cluster)
+{
+	curDir = cluster;
+	dirFirst = 0xffff;
+}
+
+/******************************************************************************/
+// SD card address of entry #(i) of the current directory: the root, or a
+// subdirectory followed through its cluster chain; 0 past its end
+unsigned long dirAddr(unsigned short i)
+{
+	unsigned short per = (unsigned short)sectorsPerCluster * 16;				// Entradas por cluster
+
+	if (curDir == 0)
+		return (i < 512) ? (rootAddr + (unsigned long)i * 32) : 0;
+	if (i < dirFirst) {															// Volta ao incio da cadeia
+		dirCluster = curDir;
+		dirFirst = 0;
+	}
+	while (i >= dirFirst + per) {
+		cmdFast(16, 2);
+		dirCluster = readWord(fatAddr + (unsigned long)dirCluster * 2);			// Prximo cluster
+		if ((dirCluster < 2) || (dirCluster > 0xfff6)) {						// Fim da cadeia
+			dirFirst = 0xffff;
+			return 0;
+		}
+		dirFirst += per;
+	}
+	return userAddr + ((unsigned long)(dirCluster - 2) << sectorsPerCluster2) * 512 +
+		(unsigned long)(i - dirFirst) * 32;
+}
+
+/******************************************************************************/
+// read entry #(i) of the current directory into (ent), 0 at its end
+// or if the card did not answer;
+// a sector is read with one command, so (i) must count up from 0 and
+// a scan stopped inside a sector must call skipDir
+unsigned char readDirNext(unsigned short i, unsigned char *ent)
+{
+	unsigned char j;
+	unsigned long adr;
+
+	if ((i & 15) == 0) {
+		adr = dirAddr(i);
+		if (adr == 0) return 0;
+		cmdFast(16, 512);
+		if (!cmd17Fast(adr)) return 0;
+	}
+	for (j = 0; j < 32; j++) ent[j] = readByteFast();
+	if ((i & 15) == 15) {
+		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	return 1;
+}
+
+/******************************************************************************/
+// discard the rest of the directory sector after entry #(i)
+void skipDir(unsigned short i)
+{
+	unsigned short n;
+
+	if ((i & 15) == 15) return;
+	for (n = (15 - (i & 15)) * 32 + 2; n; n--) readByteFast();					// + CRC
+}
+
+/******************************************************************************/
+// find a file of the current directory whose extension is targExt,
 // and whose name is targName if withName is true.
 int findExt(char *targExt, unsigned char *protect, char *targName, unsigned char withName)
 {
-	short i, j;
+	unsigned short i;
 	unsigned max_file = 512;
 	unsigned short max_time = 0, max_date = 0;
+	unsigned char *ent = dirEnt, d, prot = 0;
+	char max_name[8];
 
 	// find NIC extension
 	for (i=0; i != 512; i++) {
-		unsigned char name[8], ext[3], d;
-		unsigned char time[2], date[2];
-
-		if (bit_is_set(PIND, 3)) return 512;
-		// check first char
-		cmdFast(16, 1);
-		cmd17Fast(rootAddr + i * 32);
-		d = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if ((d == 0x00) || (d == 0x05) || (d == 0x2e) || (d == 0xe5)) continue;		// Excludo
+		if (SD_ABORT) return 512;
+		if (!readDirNext(i, ent)) break;											// Fim da cadeia de clusters
+		d = ent[0];
+		if (d == 0x00) {															// Fim do diretrio
+			skipDir(i);
+			break;
+		}
+		if ((d == 0x05) || (d == 0x2e) || (d == 0xe5)) continue;					// Excludo
 		if (!(((d >= 'A') && (d <= 'Z')) || ((d >= '0') && (d <= '9')))) continue;	// Invlido
-		cmd17Fast(rootAddr+i*32+11);												// Atributos
-		d = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
+		d = ent[11];																// Atributos
 		if (d & 0x1e) continue;														// Escondido, de sistema, volume ou diretrio
 		if (d == 0xf) continue;														// Registro LFN
-		// check extension
-		cmdFast(16, 12);
-		cmd17Fast(rootAddr + i * 32);
-		for (j=0; j!=8; j++) name[j] = readByteFast();								// Nome
-		for (j=0; j!=3; j++) ext[j] = readByteFast();								// Extenso
-		if (protect)
-			*protect = ((readByteFast() & 1) << 3);									// Somente leitura
-		else
-			readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
 
-		// check time stamp
-		cmdFast(16, 4);
-		cmd17Fast(rootAddr + i * 32 + 22);
-		time[0] = readByteFast();
-		time[1] = readByteFast();
-		date[0] = readByteFast();
-		date[1] = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-
-		if (memcmp(ext, targExt, 3) == 0) {											// Extenso achada
-			if ((!withName) || (targName && memcmp(name, targName, 8) == 0)) {		// Se no estiver procurando pelo nome ou foi passado um ponteiro
-				unsigned short tm = *(unsigned short *)time;						// de nome de arquivo e esse corresponder ao achado
-				unsigned short dt = *(unsigned short *)date;
+		if (memcmp(ent + 8, targExt, 3) == 0) {										// Extenso achada
+			if ((!withName) || (targName && memcmp(ent, targName, 8) == 0)) {		// Se no estiver procurando pelo nome ou foi passado um ponteiro
+				unsigned short tm = *(unsigned short *)(ent + 22);					// de nome de arquivo e esse corresponder ao achado
+				unsigned short dt = *(unsigned short *)(ent + 24);
 
 				if ((dt > max_date) || ((dt == max_date) && (tm >= max_time))) {	// Marca arquivo com data maior
 					max_time = tm;
 					max_date = dt;
 					max_file = i;
+					prot = ((d & 1) << 3);											// Somente leitura
+					memcpy(max_name, ent, 8);
 				}
 			}
 		}
 	}
 
-	if ((max_file != 512) && (targName != 0) && (!withName)) {						// Se achou arquivo e foi passado um ponteiro para o nome do arquivo
-		unsigned char j;															// e no est procurando por um nome, copia o nome achado para o ponteiro
-		cmdFast(16, 8);
-		cmd17Fast(rootAddr + max_file * 32);
-		for (j = 0; j < 8; j++) targName[j] = readByteFast();
-		readByteFast(); readByteFast();
+	if (max_file != 512) {
+		if (protect) *protect = prot;
+		if ((targName != 0) && (!withName))											// Se foi passado um ponteiro para o nome do arquivo e no
+			memcpy(targName, max_name, 8);											// est procurando por um nome, copia o nome achado para o ponteiro
 	}
 	return max_file;
 	// if 512 then not found...
@@ -627,25 +1058,18 @@ int findExt(char *targExt, unsigned char *protect, char *targName, unsigned char
 
 /******************************************************************************/
 // prepare a FAT table on memory
-// L a cadeia de clusters do arquivo #(i) de (len) clusters, limitando  (fatElemNum) clusters
-void prepareFat(int i, unsigned short *fat, unsigned short len, unsigned char fatNum, unsigned char fatElemNum)
+// L a cadeia de clusters do arquivo da entrada (ent) de (len) clusters, limitando  (fatElemNum) clusters
+void prepareFat(unsigned long ent, unsigned short *fat, unsigned short len, unsigned short fatNum, unsigned char fatElemNum)
 {
-	unsigned short ft;
-	unsigned char fn;
+	unsigned short ft, i, fn;
 
-	if (bit_is_set(PIND, 3)) return;												// Carto foi removido
+	if (SD_ABORT) return;															// Carto foi removido
 	cmdFast(16, (unsigned long)2);
-	cmd17Fast(rootAddr + i * 32 + 26);												// Ler cluster inicial desse arquivo
-	ft = readByteFast();
-	ft += (unsigned short)readByteFast() * 0x100;									// Cluster  16 bits little-endian
-	readByteFast(); readByteFast(); // discard CRC bytes
+	ft = readWord(ent + 26);														// Ler cluster inicial desse arquivo
 	if (0 == fatNum) fat[0] = ft;													// ?
 	for (i = 0; i < len; i++) {
 		fn = (i + 1) / fatElemNum;
-		cmd17Fast((unsigned long)fatAddr + (unsigned long)ft * 2);					// L prximo cluster
-		ft = readByteFast();
-		ft += (unsigned short)readByteFast()*0x100;
-		readByteFast(); readByteFast(); // discard CRC bytes
+		ft = readWord((unsigned long)fatAddr + (unsigned long)ft * 2);				// L prximo cluster
 		if (fn == fatNum) fat[(i + 1) % fatElemNum] = ft;							// Salva # cluster na lista
 		if ((ft > 0xfff6) || (fn > fatNum))											// Se cluster for invlido ou final, ou extrapolar
 			break;																	// limite da tabela
@@ -653,6 +1077,335 @@ void prepareFat(int i, unsigned short *fat, unsigned short len, unsigned char fa
 	cmdFast(16, (unsigned long)512);												// Prepara para ler 512 bytes
 }
 
+/******************************************************************************/
+// SD card address of block #(blk) of the mounted image
+unsigned long imageAddr(unsigned short blk)
+{
+	unsigned short long_cluster = (blk >> sectorsPerCluster2);
+	unsigned short fatNum = long_cluster / FAT_NIC_ELEMS;
+	unsigned short ft;
+
+	if (imageContig)																// Arquivo contguo: sem FAT
+		return userAddr + (((unsigned long)(imageStart - 2) << sectorsPerCluster2) + imageBase + blk) * 512;
+	if (fatNum != prevFatNumNic) {
+		prevFatNumNic = fatNum;
+		TRC(TRC_FAT, fatNum, 0);
+		prepareFat(nicEnt, fatNic, imageClusters, fatNum, FAT_NIC_ELEMS);
+	}
+	ft = fatNic[long_cluster % FAT_NIC_ELEMS];
+	return userAddr + (((unsigned long)(ft - 2) << sectorsPerCluster2) + (blk & (sectorsPerCluster - 1))) * 512;
+}
+
+/******************************************************************************/
+// read the size of the mounted image, check whether its clusters are
+// contiguous (an SDC container must be), take the disk of a container
+// and, for WOZ, check its header
+unsigned char openImage(void)
+{
+	unsigned long size;
+	unsigned long adr;
+	char id[4];
+	unsigned char i;
+	unsigned short n, ft;
+
+	if (SD_ABORT) return 0;															// Carto foi removido
+	cmdFast(16, 6);
+	if (!cmd17Fast(nicEnt + 26)) return 0;											// Cluster inicial e tamanho
+	imageStart = readByteFast();
+	imageStart += (unsigned short)readByteFast() * 0x100;
+	size = readByteFast();
+	size += (unsigned long)readByteFast() << 8;
+	size += (unsigned long)readByteFast() << 16;
+	size += (unsigned long)readByteFast() << 24;
+	readByteFast(); readByteFast(); // discard CRC bytes
+	imageClusters = (((size + 511) >> 9) + sectorsPerCluster - 1) >> sectorsPerCluster2;
+	imageContig = 0;
+	imageBase = 0;
+	if (imageStart >= 2) {
+		imageContig = 1;
+		fatBufSector = 0xffff;
+		fatBufDirty = 0;
+		for (n = 1, ft = imageStart; n < imageClusters; n++, ft++) {
+			if (readFat(ft) != ft + 1) {											// Fragmentado: usa fatNic
+				imageContig = 0;
+				break;
+			}
+		}
+	}
+	prevFatNumNic = 0xffff;
+	wozTrack = 0xff;
+	if (sdcDisk && !(imageContig && sdcSelect())) return 0;
+	if ((imageType == IMG_NIB) || (imageType == IMG_WOZ))
+		protect = 0x08;																// Trilhas cruas: somente leitura
+	if (imageType == IMG_WOZ) {
+		adr = imageAddr(0);
+		cmdFast(16, 4);
+		if (!cmd17Fast(adr)) return 0;
+		for (i = 0; i < 4; i++) id[i] = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+		if (memcmp(id, "WOZ2", 4) != 0) return 0;
+	}
+	cmdFast(16, (unsigned long)512);
+	return 1;
+}
+
+/******************************************************************************/
+// a track of a NIC image whose sector 0 starts as nicHead and nicAddress
+// write it (volume 254, as every NIC the firmware and tools/ make) only
+// streams the data field and epilogue of its sectors from the card, 346
+// of 514 bytes: the part before is played from headBuf, and no unused
+// end of the block is left to clock out before the next read. Checked
+// when the head moves to the track, so a track of a copy protected or
+// edited image with other address fields streams whole sectors
+void nicFieldCheck(unsigned char trk)
+{
+	unsigned char i;
+	unsigned long adr;
+
+	fieldOnly = 0;
+	fieldTrk = 0xff;
+	if ((imageType != IMG_NIC) || SD_ABORT) return;
+	nicHead(headBuf);
+	nicAddress(headBuf, volume, trk, 0);
+	adr = imageAddr((unsigned short)trk * 16);
+	cmdFast(16, NIC_DATA);
+	if (cmd17Fast(adr)) {
+		fieldOnly = 1;
+		fieldTrk = trk;
+		for (i = 0; i < NIC_DATA; i++)
+			if (readByteFast() != headBuf[i]) fieldOnly = 0;
+		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	cmdFast(16, (unsigned long)512);
+}
+
+/******************************************************************************/
+// read (len) bytes of index record #(n) of the SDC container whose first
+// cluster is (cluster); a record never crosses a block. 0 (and a zero
+// record) if the card did not answer
+unsigned char sdcRead(unsigned short cluster, unsigned short n, unsigned char *buf, unsigned char len)
+{
+	unsigned char i, ok;
+
+	cmdFast(16, len);
+	ok = cmd17Fast(userAddr + ((unsigned long)(cluster - 2) << sectorsPerCluster2) * 512 + (unsigned long)n * SDC_REC);
+	if (ok) {
+		for (i = 0; i < len; i++) buf[i] = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+	} else memset(buf, 0, len);
+	cmdFast(16, (unsigned long)512);
+	return ok;
+}
+
+/******************************************************************************/
+// take disk #(sdcDisk) of the mounted SDC container, disk 1 if it has no
+// such disk: its type, write protection and first block
+unsigned char sdcSelect(void)
+{
+	unsigned char r[SDC_REC];
+	unsigned short num;
+
+	if (!sdcRead(imageStart, 0, r, SDC_REC)) return 0;
+	num = *(unsigned short *)(r + SDC_COUNT);
+	if ((memcmp(r, SDC_MAGIC, 4) != 0) || (num == 0)) return 0;
+	if (sdcDisk > num) sdcDisk = 1;
+	if (!sdcRead(imageStart, sdcDisk, r, SDC_REC)) return 0;
+	if (r[SDC_TYPE] > IMG_WOZ) return 0;
+	imageType = r[SDC_TYPE];
+	if (r[SDC_FLAGS] & SDC_READONLY) protect = 0x08;
+	imageBase = *(unsigned long *)(r + SDC_FIRST);
+	return 1;
+}
+
+/******************************************************************************/
+// choose a disk of the SDC container whose first cluster is (cluster),
+// showing disk (cur) first: only the record of the disk shown is read,
+// so a container of thousands of disks browses as fast as a small one;
+// 0 is "..", to leave the container
+unsigned short sdcChoose(unsigned short cluster, unsigned short cur)
+{
+	unsigned char r[SDC_REC];
+	unsigned short num, prev = 0xffff;
+	unsigned char ev;
+
+	if (!sdcRead(cluster, 0, r, SDC_REC)) return 0;
+	num = *(unsigned short *)(r + SDC_COUNT);
+	if ((memcmp(r, SDC_MAGIC, 4) != 0) || (num > SDC_MAX)) return 0;
+	if (cur > num) cur = 0;
+
+	lcd_gotoxy(0, 0);
+	lcd_puts_p(MSG6);
+	while (1) {
+		ev = inputEvents();
+		if (!(keys & KEY_CARD)) return 0;			// Carto foi removido
+		if (ev & KEY_UP) cur = ((cur == num) ? 0 : cur + 1);
+		if (ev & KEY_DOWN) cur = (cur ? cur - 1 : num);
+		if (ev & KEY_ENTER) return cur;
+		if (prev != cur) {
+			prev = cur;
+			if (cur) {
+				if (!sdcRead(cluster, cur, r, 8)) memset(r, ' ', 8);
+				dispStr((char *)r, 1);
+			} else {
+				memset(r, ' ', 8);
+				r[0] = r[1] = '.';
+				dispStr((char *)r, 2);
+			}
+		}
+	}
+}
+
+/******************************************************************************/
+// look up the WOZ track under the head: the TMAP entry of the quarter track,
+// then its TRK entry in TRKS (start block, block count, bit count); 0 if
+// the card did not answer, leaving no track looked up
+unsigned char loadWozTrack(unsigned char qtrk)
+{
+	unsigned char trk = 0xff, ok;
+	unsigned short ofs;
+	unsigned long adr;
+
+	wozTrack = qtrk;
+	wozBlocks = 0;
+	adr = imageAddr(0);
+	cmdFast(16, 1);
+	ok = cmd17Fast(adr + 88 + qtrk);												// TMAP
+	if (ok) {
+		trk = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+		if (trk != 0xff) {															// 0xff = trilha vazia
+			ofs = 256 + (unsigned short)trk * 8;
+			adr = imageAddr(ofs >> 9) + (ofs & 0x1ff);
+			cmdFast(16, 8);
+			ok = cmd17Fast(adr);													// TRKS
+		}
+	}
+	if (ok && (trk != 0xff)) {
+		wozStart = readByteFast();
+		wozStart += (unsigned short)readByteFast() * 0x100;
+		wozBlocks = readByteFast();
+		wozBlocks += (unsigned short)readByteFast() * 0x100;
+		wozBits = readByteFast();
+		wozBits += (unsigned long)readByteFast() << 8;
+		wozBits += (unsigned long)readByteFast() << 16;
+		wozBits += (unsigned long)readByteFast() << 24;
+		readByteFast(); readByteFast(); // discard CRC bytes
+		if (wozBits == 0) wozBlocks = 0;
+	}
+	if (!ok) wozTrack = 0xff;														// look it up again
+	cmdFast(16, (unsigned long)512);
+	return ok;
+}
+
+/******************************************************************************/
+// raw NIB and WOZ tracks have no gap to hide a read in, so they are not
+// streamed block by block: sub.S plays them from a ring in writeData
+// (prepare 4) while the main loop reads the track ahead into it, with
+// Timer0 running. Start playing track (trk) from the ring, 0 if there
+// is no data under the head or the card did not answer
+unsigned char rawStart(unsigned char trk)
+{
+	unsigned char ok = 1;
+
+	if ((imageType == IMG_WOZ) && (ph_track != wozTrack)) ok = loadWozTrack(ph_track);
+	if (ok && (imageType == IMG_WOZ) && !wozBlocks) return 0;					// Trilha vazia
+	rawTrk = trk;
+	rawSrc = 0;
+	rawCarry = rawShift = 0;
+	rawPtr = rawStop = rawRing;
+	rawByte = 0x80;																// nothing left: take a byte first
+	if (!ok || !rawFillRing() || !rawFillRing()) {
+		if (++sdErrors == SD_MAX_ERRORS) inited = 0;							// card stuck: mount again
+		return 0;
+	}
+	sdErrors = 0;
+	return 1;
+}
+
+/******************************************************************************/
+// put the next RAW_CHUNK bytes of the track in the ring, going on from
+// its start after its end; a WOZ track ends within a byte, so its bits
+// are packed on without a seam. sub.S leaves the main loop about a
+// fifth of the CPU, so bytes come from readByteRaw and a byte aligned
+// track is copied as it is
+unsigned char rawFillRing(void)
+{
+	unsigned short len, n, m;
+	unsigned char b, k, f, last = 0;
+	unsigned char *w = rawStop;
+	unsigned long adr;
+
+	len = ((imageType == IMG_NIB) ? 6656 : (unsigned short)((wozBits + 7) >> 3));
+	if (rawSrc >= len) rawSrc = 0;
+	n = len - rawSrc;
+	if (n > RAW_CHUNK) n = RAW_CHUNK;
+	adr = imageAddr(((imageType == IMG_NIB) ? (unsigned short)rawTrk * 13 : wozStart) + (rawSrc >> 9));
+	cmdFast(16, n);
+	if (!cmd17Fast(adr + (rawSrc & 0x1ff))) {
+		cmdFast(16, (unsigned long)512);
+		return 0;
+	}
+	rawSrc += n;
+	if ((imageType == IMG_WOZ) && (rawSrc == len) && (wozBits & 7)) {
+		last = (wozBits & 7);													// bits of the last byte
+		n--;
+	}
+	k = rawShift;
+	if (k == 0) {
+		while (n--) {
+			*w = readByteRaw();
+			if (++w == rawRing + RAW_SIZE) w = rawRing;
+		}
+	} else {
+		f = (1 << (8 - k));
+		while (n--) {
+			m = (unsigned short)readByteRaw() * f;							// b >> k : b << (8 - k) in one mul
+			*w = (rawCarry | (m >> 8));
+			rawCarry = m;
+			if (++w == rawRing + RAW_SIZE) w = rawRing;
+		}
+	}
+	if (last) {
+		b = (readByteRaw() & (0xff00 >> last));
+		rawCarry |= (b >> k);
+		if ((k += last) >= 8) {
+			*w = rawCarry;
+			if (++w == rawRing + RAW_SIZE) w = rawRing;
+			k -= 8;
+			rawCarry = (b << (last - k));
+		}
+		rawShift = k;
+	}
+	readByteRaw(); readByteRaw(); // discard CRC bytes
+	cmdFast(16, (unsigned long)512);
+	cli();
+	rawStop = w;
+	sei();
+	return 1;
+}
+
+/******************************************************************************/
+// a raw track is playing: read the next chunk into the ring when it has
+// room for one (one byte stays free, rawPtr == rawStop is empty; sub.S
+// goes to prepare 1 if it runs dry); start again if the head moved to
+// another WOZ quarter track of the same track
+void rawKeep(void)
+{
+	unsigned char *p;
+	short room;
+
+	if ((imageType == IMG_WOZ) && (ph_track != wozTrack)) {
+		prepare = 1;
+		return;
+	}
+	cli();
+	p = rawPtr;
+	sei();
+	room = (p - rawStop);
+	if (room <= 0) room += RAW_SIZE;
+	if (room - 1 >= RAW_CHUNK) rawFillRing();
+}
+
 /******************************************************************************/
 // memory copy
 void memcp(unsigned char *dst, unsigned char *src, unsigned short len)
@@ -663,30 +1416,29 @@ void memcp(unsigned char *dst, unsigned char *src, unsigned short len)
 }
 
 /******************************************************************************/
-// write to the SD cart one by one
-void writeSD(unsigned long adr, unsigned char *data, unsigned short len)
+// send a 512-byte block to the SD card: the card is left programming it,
+// waitFinish() waits for the end
+void writeStart(unsigned long adr, unsigned char *buf)
 {
-	unsigned int i;
-	unsigned char *buf = &writeData[0][0];
-
-	if (bit_is_set(PIND, 3)) return;												// Carto foi removido
+	unsigned short i;
 
-	cmdFast(16, 512);																// Ler 512 bytes
-	cmd17Fast(adr & 0xfffffe00);													// Filtrar endereo
-	for (i = 0; i < 512; i++) buf[i] = readByteFast();								// Ler e salvar em *buf
-	readByteFast(); readByteFast(); // discard CRC bytes
-	memcp( &(buf[adr & 0x1ff]), data, len);											// Copiar dados para *buf
-	
 	PORTD = NCLKNDI_CS;
 	PORTD = NCLKNDINCS;
 				
-	cmdFast(24, adr & 0xfffffe00);													// Endereo de gravao
+	cmdFast(24, adr);																// Endereo de gravao
 	writeByteFast(0xff);															// Obrigatrio enviar isso
 	writeByteFast(0xfe);															// Obrigatrio enviar isso
 	for (i = 0; i < 512; i++) writeByteFast(buf[i]);								// Enviar dados para gravao
 	writeByteFast(0xff);															// CRC falso
 	writeByteFast(0xff);															// CRC falso
 	readByteFast();																	// Ler byte de status (ignora)
+}
+
+/******************************************************************************/
+// write a 512-byte block to the SD card
+void writeBlock(unsigned long adr, unsigned char *buf)
+{
+	writeStart(adr, buf);
 	waitFinish();																	// Espera terminar a gravao
 	
 	PORTD = NCLKNDI_CS;
@@ -694,442 +1446,644 @@ void writeSD(unsigned long adr, unsigned char *data, unsigned short len)
 }
 
 /******************************************************************************/
-// duplicate FAT for FAT16
-void duplicateFat(void)
+// write to the SD cart one by one; 0, writing nothing, if the block
+// could not be read first
+unsigned char writeSD(unsigned long adr, unsigned char *data, unsigned short len)
 {
-	unsigned short i, j;
-	unsigned long adr = fatAddr;
-	unsigned char *buf = &writeData[0][0];
+	unsigned int i;
+	unsigned char *buf = writeData;
 
-	if (bit_is_set(PIND, 3)) return;												// Carto foi removido
+	if (SD_ABORT) return 0;															// Carto foi removido
 
 	cmdFast(16, 512);																// Ler 512 bytes
-	for (j = 0; j < sectorsPerFat; j++) {
-		cmd17Fast(adr);
-		for (i=0; i < 512; i++) buf[i] = readByteFast();
+	if (!cmd17Fast(adr & 0xfffffe00)) return 0;										// Filtrar endereo
+	for (i = 0; i < 512; i++) buf[i] = readByteFast();								// Ler e salvar em *buf
+	readByteFast(); readByteFast(); // discard CRC bytes
+	memcp( &(buf[adr & 0x1ff]), data, len);											// Copiar dados para *buf
+	writeBlock(adr & 0xfffffe00, buf);
+	return 1;
+}
+
+/******************************************************************************/
+// read a FAT entry, loading its sector into fatBuf; 0xffff (the end of
+// a chain, never free) if the card did not answer
+unsigned short readFat(unsigned short cluster)
+{
+	unsigned short i;
+	unsigned char *p;
+
+	if ((cluster >> 8) != fatBufSector) {
+		flushFat();
+		fatBufSector = 0xffff;
+		cmdFast(16, 512);
+		if (!cmd17Fast(fatAddr + (unsigned long)(cluster >> 8) * 512)) return 0xffff;
+		fatBufSector = (cluster >> 8);
+		for (i = 0; i < 512; i++) fatBuf[i] = readByteFast();
 		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	p = fatBuf + (cluster & 0xff) * 2;
+	return p[0] + (unsigned short)p[1] * 0x100;
+}
 
-		PORTD = NCLKNDI_CS;
-		PORTD = NCLKNDINCS;
-		
-		cmdFast(24, adr + (unsigned long)sectorsPerFat * 512);
-		writeByteFast(0xff);
-		writeByteFast(0xfe);
-		for (i = 0; i < 512; i++) writeByteFast(buf[i]);
-		writeByteFast(0xff);
-		writeByteFast(0xff);
-		readByteFast();
-		waitFinish();
-		adr += 512;
-		
-		PORTD = NCLKNDI_CS;
-		PORTD = NCLKNDINCS;
+/******************************************************************************/
+// write a FAT entry in fatBuf, the sector is written by flushFat
+void writeFat(unsigned short cluster, unsigned short val)
+{
+	unsigned char *p;
+
+	readFat(cluster);
+	if (fatBufSector != (cluster >> 8)) return;										// Setor no lido
+	p = fatBuf + (cluster & 0xff) * 2;
+	p[0] = (val & 0xff);
+	p[1] = (val >> 8);
+	fatBufDirty = 1;
+}
+
+/******************************************************************************/
+// write a modified FAT sector to FAT #1 and, in the same batch, to FAT #2
+void flushFat(void)
+{
+	unsigned long adr = fatAddr + (unsigned long)fatBufSector * 512;
+
+	if (!fatBufDirty) return;
+	fatBufDirty = 0;
+	if (SD_ABORT) return;															// Carto foi removido
+	cmdFast(16, 512);
+	writeBlock(adr, fatBuf);
+	writeBlock(adr + (unsigned long)sectorsPerFat * 512, fatBuf);
+}
+
+/******************************************************************************/
+// find the first free cluster run of (need) clusters; if there is none,
+// return the longest run and its length in (*len), 0 if the FAT is full
+unsigned short freeRun(unsigned short need, unsigned short *len)
+{
+	unsigned short ft, run, best, maxCluster;
+
+	maxCluster = ((sectorsPerFat > 0xff) ? 0xfff0 : (sectorsPerFat << 8));		// FAT entries
+	if (clusterEnd < maxCluster) maxCluster = clusterEnd;							// the volume ends first
+	run = best = *len = 0;
+	for (ft = 2; ft < maxCluster; ft++) {
+		if (SD_ABORT) break;														// Carto foi removido
+		if (readFat(ft) == 0) {														// Se cluster for 0, est vazio
+			if (++run == need) {
+				*len = need;
+				return ft - need + 1;
+			}
+			if (run > *len) {
+				*len = run;
+				best = ft - run + 1;
+			}
+		} else run = 0;
 	}
+	return best;
 }
 
 /******************************************************************************/
 // create a file image
 int createFile(char *name, char *ext, unsigned short sectNum)
 {
-	unsigned short re, clusterNum;
-	unsigned long ft, adr;
-	unsigned short d, i;
-	unsigned char c, dirEntry[32], at;
-	static unsigned char last[2] = {0xff, 0xff};
+	unsigned short re, need, first, prev, ft, len;
+	unsigned short i;
+	unsigned char *dirEntry = dirEnt;
 
-	if (bit_is_set(PIND, 3)) return 0;												// Carto foi removido
-	
-	for (i = 0; i < 32; i++) dirEntry[i] = 0;										// Zera estrutura
-	memcp(dirEntry, (unsigned char *)name, 8);										// Nome do arquivo
-	memcp(dirEntry+8, (unsigned char*)ext, 3);										// Extenso do arquivo
-	*(unsigned long *)(dirEntry + 28) = (unsigned long)sectNum * 512;				// Tamanho em bytes do arquivo
-	
-	// search a root directory entry
+	if (SD_ABORT) return 0;															// Carto foi removido
+
+	// search an entry of the current directory (dirEntry is the buffer),
+	// a full subdirectory gets one more cluster
 	for (re = 0; re < 512; re++) {
-		cmdFast(16, 1);
-		cmd17Fast(rootAddr + re * 32 + 0);
-		c = readByteFast();															// Primeiro char do nome do arquivo
-		readByteFast(); readByteFast(); // discard CRC bytes
-		cmd17Fast(rootAddr + re * 32 + 11);
-		at = readByteFast();														// Atributo do arquivo
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (((c == 0xe5) || (c == 0x00)) && (at != 0xf))							// find a RDE! (Procura uma posio vaga)
+		if (!readDirNext(re, dirEntry)) {											// Fim da cadeia de clusters
+			if (!dirExtend(re)) re = 512;
+			break;
+		}
+		if (((dirEntry[0] == 0xe5) || (dirEntry[0] == 0x00)) && (dirEntry[11] != 0xf)) {	// find a RDE! (Procura uma posio vaga)
+			skipDir(re);
 			break;
-	}	
+		}
+	}
 	if (re == 512)																	// No achou!! :(
 		return 0;
-	// write a directory entry
-	writeSD(rootAddr + re * 32, dirEntry, 32);
-	if (sectNum == 0) {																// Se arquivo tiver zero bytes,
-		duplicateFat();																// Duplicar FAT e sair
-		return 1;
+
+	for (i = 0; i < 32; i++) dirEntry[i] = 0;										// Zera estrutura
+	memcp(dirEntry, (unsigned char *)name, 8);										// Nome do arquivo
+	memcp(dirEntry+8, (unsigned char*)ext, 3);										// Extenso do arquivo
+	*(unsigned long *)(dirEntry + 28) = (unsigned long)sectNum * 512;				// Tamanho em bytes do arquivo
+
+	// link a contiguous free run, or if there is none, the longest runs
+	// left, so the image is made of as few extents as possible
+	need = ( sectNum + sectorsPerCluster - 1 ) >> sectorsPerCluster2;
+	first = prev = 0;
+	fatBufSector = 0xffff;
+	fatBufDirty = 0;
+	while (need) {
+		if (SD_ABORT) return 0;														// Carto foi removido
+		ft = freeRun(need, &len);
+		if (ft == 0) break;															// Disco cheio
+		need -= len;
+		for (; len; len--, ft++) {
+			if (prev) writeFat(prev, ft); else first = ft;
+			prev = ft;
+		}
+		writeFat(prev, 0xffff);														// Fim de arquivo (por enquanto)
 	}
-	// search the first fat entry
-	adr = (rootAddr + re * 32 + 26);												// Endereo do Nmero do cluster inicial (Dentro da entrada de diretrio)
-	clusterNum = 0;
-	for (ft=2; (clusterNum < ( ( sectNum + sectorsPerCluster - 1 ) >> sectorsPerCluster2 ) ); ft++) {
-		cmdFast(16, 2);
-		cmd17Fast(fatAddr + ft * 2);
-		d = readByteFast();
-		d += (unsigned short)readByteFast() * 0x100;
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (d==0) {																	// Se cluster for 0, est vazio
-			clusterNum++;
-			writeSD(adr, (unsigned char *)&ft, 2);									// Salva nmero do cluster vazio
-			adr = fatAddr + ft * 2;													// Aponta para o prximo cluster
+	if (need) {																		// Disco cheio: libera a cadeia
+		for (ft = first; ft && (ft < 0xfff7); ft = prev) {
+			prev = readFat(ft);
+			writeFat(ft, 0);
 		}
+		flushFat();
+		return 0;
 	}
-	writeSD(adr, last, 2);															// Salva 0xFFFF para indicar fim de arquivo
-	duplicateFat();
-	return 1;
+	flushFat();
+
+	// write a directory entry
+	*(unsigned short *)(dirEntry + 26) = first;										// Cluster inicial
+	return writeSD(dirAddr(re), dirEntry, 32);
 }
 
 /******************************************************************************/
-// translate a DSK image into a NIC image
-void dsk2Nic(void)
+// remove the file of the directory entry at (adr): free its cluster
+// chain and mark the entry deleted
+void removeFile(unsigned long adr)
 {
-	unsigned char trk, logic_sector;
-
-	unsigned short i;
-	unsigned char *dst = (&writeData[0][0] + 512);
-	unsigned short *fatDsk = (unsigned short *)(&writeData[0][0] + 1024);
+	unsigned short ft, next;
+
+	if (SD_ABORT) return;															// Carto foi removido
+	cmdFast(16, 2);
+	ft = readWord(adr + 26);														// Cluster inicial
+	fatBufSector = 0xffff;
+	fatBufDirty = 0;
+	for (; (ft >= 2) && (ft < 0xfff7); ft = next) {
+		next = readFat(ft);
+		writeFat(ft, 0);
+	}
+	flushFat();
+	writeSD(adr, (unsigned char *)"\xe5", 1);										// Entrada apagada
+}
 
-	PORTB |= 0b00110000;
-
-	prevFatNumNic = prevFatNumDsk = 0xff;
+/******************************************************************************/
+// give the current subdirectory, whose cluster chain ends before entry
+// #(i), one more cluster of free entries; 0 for the root, which cannot
+// grow, if the chain goes on (the read of entry #(i) failed) or if the
+// volume is full
+unsigned char dirExtend(unsigned short i)
+{
+	unsigned short cl, next, len, j;
+
+	if ((curDir == 0) || dirAddr(i) || SD_ABORT) return 0;
+	fatBufSector = 0xffff;
+	fatBufDirty = 0;
+	for (cl = curDir; ((next = readFat(cl)) >= 2) && (next < 0xfff7); cl = next) ;	// ltimo cluster
+	if (fatBufSector != (cl >> 8)) return 0;										// Setor no lido
+	next = freeRun(1, &len);
+	if (next == 0) return 0;														// Disco cheio
+	writeFat(next, 0xffff);
+	writeFat(cl, next);
+	flushFat();
+	memset(writeData, 0, 512);														// Entradas vagas
+	for (j = 0; j < sectorsPerCluster; j++)
+		writeBlock(userAddr + (((unsigned long)(next - 2) << sectorsPerCluster2) + j) * 512, writeData);
+	setDir(curDir);																	// dirAddr walks the chain again
+	return 1;
+}
 
-	for (i = 0; i < 0x16; i++) dst[i] = 0xff;
+/******************************************************************************/
+// translate a DSK image into a NIC image, as a pipeline: a sector is
+// encoded while the card programs the one before, the DSK block it
+// needs having been read before that write was started (the card takes
+// no read while programming); only the encoding buffer is needed, as
+// it is free once the previous sector has been sent. 0 if a sector could
+// not be read or written: the NIC image is left half written
+unsigned char dsk2Nic(void)
+{
+	unsigned char trk, logic_sector, ph_sector, ok = 1;
+	unsigned short n, i, place;
+	unsigned long adr = 0, nextAdr = 0;
+	unsigned char *dst = (writeData + 512);
+	unsigned short *fatDsk = (unsigned short *)(writeData + 1024);
 
-	// sync header
-	dst[0x16] = 0x03;
-	dst[0x17] = 0xfc;
-	dst[0x18] = 0xff;
-	dst[0x19] = 0x3f;
-	dst[0x1a] = 0xcf;
-	dst[0x1b] = 0xf3;
-	dst[0x1c] = 0xfc;
-	dst[0x1d] = 0xff;
-	dst[0x1e] = 0x3f;
-	dst[0x1f] = 0xcf;
-	dst[0x20] = 0xf3;
-	dst[0x21] = 0xfc;
-	
-	// address header
-	dst[0x22] = 0xd5;
-	dst[0x23] = 0xaa;
-	dst[0x24] = 0x96;
-	dst[0x2d] = 0xde;
-	dst[0x2e] = 0xaa;
-	dst[0x2f] = 0xeb;
-	
-	// sync header
-	for (i=0x30; i<0x35; i++) dst[i]=0xff;
-	
-	// data
-	dst[0x35] = 0xd5;
-	dst[0x36] = 0xaa;
-	dst[0x37] = 0xad;
-	dst[0x18f] = 0xde;
-	dst[0x190] = 0xaa;
-	dst[0x191] = 0xeb;
-	for (i = 0x192; i < 0x1a0; i++)
-		dst[i]=0xff;
-	for (i = 0x1a0; i < 0x200; i++)
-		dst[i]=0x00;
+	PORTB |= 0b00110000;
 
-	cmdFast(16, (unsigned long)512);	
-	for (trk = 0; trk < 35; trk++) {
-		PORTB ^= 0b00110000; // blink red LED
-		for (logic_sector = 0; logic_sector < 16; logic_sector++) {
-			unsigned char *src;
-			unsigned short ph_sector = (unsigned short)pgm_read_byte_near(physicalSector + logic_sector);
+	prevFatNumNic = 0xffff;
+	prevFatNumDsk = 0xff;
 
-			if (bit_is_set(PIND, 3)) return;														// Carto removido
+	nicTemplate(dst);
 
-			if ((logic_sector & 1) == 0) {
-				unsigned short long_sector = (unsigned short)trk * 8 + (logic_sector / 2);
+	cmdFast(16, (unsigned long)512);	
+	for (n = 0; ok && (n <= 35 * 16); n++) {										// n: sector encoded, n - 1: sector written
+		trk = n >> 4;
+		logic_sector = n & 15;
+		place = nicPlace(n, 'D');													// track * 16 + physical sector
+		ph_sector = (place & 15);
+
+		if (SD_ABORT) {																// Carto removido
+			ok = 0;
+			break;
+		}
+		if (n < 35 * 16) {
+			if (logic_sector == 0) PORTB ^= 0b00110000;								// blink red LED
+			if ((logic_sector & 1) == 0) {											// Bloco do DSK com este setor e o prximo
+				unsigned short long_sector = n / 2;
 				unsigned short long_cluster = (long_sector >> sectorsPerCluster2);
 				unsigned char fatNum = long_cluster / FAT_DSK_ELEMS;
 				unsigned short ft;
 
 				if (fatNum != prevFatNumDsk) {
 					prevFatNumDsk = fatNum;						
-					prepareFat(dskDir, fatDsk, ((280 + sectorsPerCluster - 1) >> sectorsPerCluster2), fatNum, FAT_DSK_ELEMS);
+					prepareFat(dskEnt, fatDsk, ((280 + sectorsPerCluster - 1) >> sectorsPerCluster2), fatNum, FAT_DSK_ELEMS);
 				}
-				ft = fatDsk[long_cluster % FAT_DSK_ELEMS];											// Pega nmero do cluster do arquivo
-				cmd17Fast(
-						(unsigned long)userAddr + ( ( (unsigned long)(ft-2) << sectorsPerCluster2) + (long_sector & (sectorsPerCluster - 1) ) ) * (unsigned long)512);
-				for (i = 0; i < 512; i++) {
-					if (bit_is_set(PIND, 3)) return;
-					*(&writeData[0][0] + i) = readByteFast();
+				ft = fatDsk[long_cluster % FAT_DSK_ELEMS];									// Pega nmero do cluster do arquivo
+				if (!cmd17Fast(
+						(unsigned long)userAddr + ( ( (unsigned long)(ft-2) << sectorsPerCluster2) + (long_sector & (sectorsPerCluster - 1) ) ) * (unsigned long)512)) {
+					ok = 0;
+					break;
 				}
+				for (i = 0; i < 512; i++) writeData[i] = readByteFast();
 				readByteFast(); readByteFast(); // discard CRC bytes				
-				src = &writeData[0][0];
-			} else {
-				src = (&writeData[0][0]+256);
-			}
-			{
-				unsigned char c, x, ox = 0;
-
-				dst[0x25] = ((volume >> 1) | 0xAA);
-				dst[0x26] = (volume | 0xAA);
-				dst[0x27] = ((trk >> 1) | 0xAA);
-				dst[0x28] = (trk | 0xAA);
-				dst[0x29] = ((ph_sector >> 1) | 0xAA);
-				dst[0x2a] = (ph_sector | 0xAA);
-				c = (volume ^ trk ^ ph_sector);
-				dst[0x2b] = ((c >> 1) | 0xAA);
-				dst[0x2c] = (c | 0xAA);
-				for (i = 0; i < 86; i++) {
-					x = (pgm_read_byte_near(FlipBit1 + (src[i] & 3)) |
-						pgm_read_byte_near(FlipBit2 + (src[i + 86] & 3)) |
-						((i <= 83) ? pgm_read_byte_near(FlipBit3 + (src[i + 172] & 3)) : 0));
-					dst[i + 0x38] = pgm_read_byte_near(encTable + (x ^ ox));
-					ox = x;
-				}
-				for (i = 0; i < 256; i++) {
-					x = (src[i] >> 2);
-					dst[i + 0x8e] = pgm_read_byte_near(encTable + (x ^ ox));
-					ox = x;
-				}
-				dst[0x18e] = pgm_read_byte_near(encTable + ox);
-			}
-			{
-				unsigned char c, d;
-				unsigned short long_sector = (unsigned short)trk * 16 + ph_sector;
-				unsigned short long_cluster = (long_sector >> sectorsPerCluster2);
-				unsigned char fatNum = long_cluster / FAT_NIC_ELEMS;
-				unsigned short ft;
-			
-				if (fatNum != prevFatNumNic) {
-					prevFatNumNic = fatNum;
-					prepareFat(nicDir, fatNic, ((560 + sectorsPerCluster - 1) >> sectorsPerCluster2), fatNum, FAT_NIC_ELEMS);
-				}
-				ft = fatNic[long_cluster % FAT_NIC_ELEMS];
-
-				PORTD = NCLKNDI_CS;
-				PORTD = NCLKNDINCS;
-
-				cmdFast(24, userAddr + (((unsigned long)(ft - 2) << sectorsPerCluster2)
-					+ (long_sector & (sectorsPerCluster - 1))) * (unsigned long)512);
-				writeByteFast(0xff);
-				writeByteFast(0xfe);
-				for (i = 0; i < 512; i++) {
-					if (bit_is_set(PIND,3)) return;
-					c = dst[i];
-					for (d = 0b10000000; d; d >>= 1) {
-						if (c & d) {
-							PORTD = NCLK_DINCS;
-							PORTD = _CLK_DINCS;
-						} else {
-							PORTD = NCLKNDINCS;
-							PORTD = _CLKNDINCS;
-						}
-					}
-				}
-				PORTD = NCLKNDINCS;
-				writeByteFast(0xff);
-				writeByteFast(0xff);
-				readByteFast();
-				waitFinish();
-				
-				PORTD = NCLKNDI_CS;
-				PORTD = NCLKNDINCS;
 			}
+			nextAdr = imageAddr(place);												// Pode ler a FAT: antes da gravao
+		}
+		if (n) writeStart(adr, dst);												// Setor anterior: o carto grava...
+		if (n < 35 * 16)															// ...enquanto este  codificado
+			nicSector(dst, (logic_sector & 1) ? (writeData + 256) : writeData, volume, trk, ph_sector);
+		if (n) {
+			ok = waitFinish();
+			PORTD = NCLKNDI_CS;
+			PORTD = NCLKNDINCS;
 		}
+		adr = nextAdr;
 	}
-	buffClear();
+	if (ok) buffClear();
 	PORTB &= 0b11101111; // off red LED
+	return ok;
 }
 
 /******************************************************************************/
-// make file name list and sort
-unsigned short makeFileNameList(unsigned short *list, char *targExt)
+// make the list of the current directory: its subdirectories (and "..")
+// first, then the files with any of the (extNum) extensions in targExt,
+// sorted by name; a directory is read once, one command per sector
+unsigned short makeFileNameList(struct dirItem *list, char *targExt, unsigned char extNum)
 {
-	unsigned short i, j, k, entryNum = 0;
-	char name1[8], name2[8];
+	unsigned short i, j, entryNum = 0;
+	unsigned char *ent = dirEnt, d;
+	struct dirItem it;
 
 	lcd_gotoxy(0, 0);
 	lcd_puts_p(MSG5);
 
 	// find extension
 	for (i = 0; i != 512; i++) {
-		unsigned char ext[3], d;
-
-		if (bit_is_set(PIND, 3)) return 512;										// Carto removido
-		// check first char
-		cmdFast(16, 1);
-		cmd17Fast(rootAddr + i * 32);
-		d = readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if ((d == 0x00) || (d == 0x05) || (d == 0x2e) || (d == 0xe5))				// Entrada livre
-			continue;
-		if (!((( d>= 'A') && (d <= 'Z')) || ((d >= '0') && (d <= '9'))))			// Entrada invlida
+		if (entryNum == LIST_MAX) {													// Lista cheia
+			skipDir(i - 1);
+			break;
+		}
+		if (SD_ABORT) return 0;														// Carto removido
+		if (!readDirNext(i, ent)) break;											// Fim da cadeia de clusters
+		d = ent[0];
+		if (d == 0x00) {															// Fim do diretrio
+			skipDir(i);
+			break;
+		}
+		if ((d == 0x05) || (d == 0xe5))												// Entrada livre
 			continue;
-		cmd17Fast(rootAddr + i * 32 + 11);
-		d = readByteFast();															// Atributo
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (d & 0x1e) 																// Arquivo de sistema
+		if ((ent[11] == 0xf) || (ent[11] & 0x0e))									// Entrada LFN, arquivo de sistema ou volume
 			continue;
-		if (d == 0xf) 																// Entrada LFN
+		if ((d == '.') && (ent[1] == '.') && (ent[11] & 0x10))						// ".." volta ao diretrio pai
+			;
+		else if (!((( d>= 'A') && (d <= 'Z')) || ((d >= '0') && (d <= '9'))))		// Entrada invlida (ou ".")
 			continue;
-		// check extension
-		cmdFast(16, 3);
-		cmd17Fast(rootAddr + i * 32 + 8);
-		for (j = 0; j != 3; j++)
-			ext[j]=readByteFast();
-		readByteFast(); readByteFast(); // discard CRC bytes
-		if (memcmp(ext, targExt, 3) == 0) {											// Extenso achada
-			list[entryNum++] = i;
+		if (ent[11] & 0x10)															// Diretrio
+			it.ent = i | DIR_FLAG;
+		else {
+			// check extension
+			for (j = 0; j != extNum; j++)
+				if (memcmp(ent + 8, targExt + j * 3, 3) == 0) break;				// Extenso achada
+			if (j == extNum) continue;
+			it.ent = i;
+			if (memcmp(ent + 8, SDC_EXT, 3) == 0) it.ent |= SDC_FLAG;
 		}
-	}
-	// sort
-	if (entryNum > 1)
-		for (i = 0; i <= (entryNum - 2); i++) {
-			for (j = 1; j <= (entryNum - i - 1); j++) {
-				getFileName(list[j], name1);
-				getFileName(list[j-1], name2);
-			if (memcmp(name1, name2, 8) < 0) {
-				k = list[j];
-				list[j] = list[j - 1];
-				list[j - 1]=k;
-			}
+		memcpy(it.name, ent, 8);
+		// insert sorted, directories first
+		for (j = entryNum; j; j--) {
+			if (((list[j - 1].ent ^ it.ent) & DIR_FLAG) ? (it.ent & DIR_FLAG) == 0 :
+				(memcmp(list[j - 1].name, it.name, 8) <= 0))
+				break;
+			list[j] = list[j - 1];
 		}
+		list[j] = it;
+		entryNum++;
 	}
 	return entryNum;
 }
 
 /******************************************************************************/
-// choose a NIC file from a NIC file name list
+// choose a NIC file from a NIC file name list, entering directories and
+// SDC containers (sdcDisk is the disk chosen in one, else 0); the current
+// directory is left at the one of the chosen file
 unsigned char chooseANicFile(void *tempBuff, unsigned char btfExists, char *filebase)
 {
-	unsigned short *list = (unsigned short *)tempBuff;
-	unsigned short num = makeFileNameList(list, "NIC");
-	char name[8];
-	short cur = 0, prevCur = -1;
+	struct dirItem *list = (struct dirItem *)tempBuff;
+	unsigned short num;
+	short cur, prevCur;
 	unsigned long i;
-	unsigned char flagb = 0xFF;
+	unsigned char ev;
+	unsigned char *ent = dirEnt;
 
-	lcd_gotoxy(0, 0);
-	lcd_puts_p(MSG6);
+	while (1) {
+		num = makeFileNameList(list, IMG_EXTS, IMG_EXT_NUM);
+		// if there is no NIC file nor directory
+		if (num == 0) return 0;
+
+		lcd_gotoxy(0, 0);
+		lcd_puts_p(MSG6);
 
-	// if there is at least one NIC file,
-	if (num > 0) {
 		// determine first file
+		cur = 0;
+		prevCur = -1;
 		if (btfExists) {
 			for (i = 0; i < num; i++) {
-				getFileName(list[i], name);
-				if (memcmp(name, filebase, 8)==0) {
+				if (!(list[i].ent & DIR_FLAG) && (memcmp(list[i].name, filebase, 8)==0)) {
 					cur = i;
 					break;
 				}
 			}
 		}
 		while (1) {
-			if (bit_is_set(PIND, 3)) return 0;			// Carto foi removido
-			if (bit_is_clear(PINB, 5)) {				// up button pushed !
-				if (flagb & 0x01) {
-					_delay_ms(100);
-					while (bit_is_clear(PINB, 5)) nop();
-					cur++;
-					if (cur == num) cur = 0;
-				}
-				flagb &= ~0x01;
-			} else {
-				flagb |= 0x01;
-			}
-
-			if (bit_is_clear(PIND, 7)) {				// down button pushed !
-				if (flagb & 0x02) {
-					_delay_ms(100);
-					while (bit_is_clear(PIND, 7)) nop();
-					cur--;
-					if (cur < 0) cur = num-1;
-				}
-				flagb &= ~0x02;
-			} else {
-				flagb |= 0x02;
+			ev = inputEvents();
+			if (!(keys & KEY_CARD)) return 0;			// Carto foi removido
+			if (ev & KEY_UP) {							// up button pushed (or held) !
+				cur++;
+				if (cur == num) cur = 0;
 			}
-			if (bit_is_clear(PIND, 6)) {				// enter button pushed !
-				unsigned char flg = 1;
-
-				for (i=0; i!=100; i++) if (bit_is_set(PIND, 6)) flg = 0;
-				if (flg) {
-					while (bit_is_clear(PIND, 6)) nop();
-					break;
-				}
+			if (ev & KEY_DOWN) {						// down button pushed (or held) !
+				cur--;
+				if (cur < 0) cur = num-1;
 			}
+			if (ev & KEY_ENTER)							// enter button pushed !
+				break;
 
 			// display file name
 			if (prevCur != cur) {
 				prevCur = cur;
 
-				getFileName(list[cur], name);
-				dispStr(name, 1);
+				dispStr(list[cur].name, (list[cur].ent & DIR_FLAG) ? 2 : ((list[cur].ent & SDC_FLAG) ? 3 : 1));
 			}
-			_delay_ms(10);
 		}
-		getFileName(list[cur], name);
-		memcpy(filebase, name, 8);
+		if (list[cur].ent & SDC_FLAG) {
+			// choose a disk in the container, ".." lists the directory again
+			if (readDirEntry(dirAddr(list[cur].ent & ~SDC_FLAG), ent))
+				sdcDisk = sdcChoose(*(unsigned short *)(ent + 26), 1);
+			else sdcDisk = 0;
+			if (sdcDisk) break;
+			continue;
+		}
+		sdcDisk = 0;
+		if (!(list[cur].ent & DIR_FLAG)) break;
 
-		return 1;
-	} else {
-		return 0;
+		// enter the directory, ".." of a first level directory is cluster 0 (root)
+		i = dirAddr(list[cur].ent & ~DIR_FLAG);
+		cmdFast(16, 2);
+		setDir(readWord(i + 26));
 	}
+	memcpy(filebase, list[cur].name, 8);
+
+	return 1;
 }
 
 /******************************************************************************/
-// initialization called from check_eject
-void init(unsigned char choose)
+// read the card identification register (CMD10), 0 (and a zero cid)
+// if the card did not send it
+unsigned char readCid(unsigned char *cid)
+{
+	unsigned char i, ch;
+	unsigned short w = SD_READ_WAIT;
+
+	memset(cid, 0, 16);
+	if (cmdFast(10, 0)) return 0;
+	do {
+		ch = readByteFast();
+	} while ((ch != 0xfe) && --w);
+	if (ch != 0xfe) return 0;
+	for (i = 0; i < 16; i++) cid[i] = readByteFast();
+	readByteFast(); readByteFast(); // discard CRC bytes
+	return 1;
+}
+
+/******************************************************************************/
+// read a 32-byte directory entry; 0 (and a zero entry, which is no
+// entry) if the card did not answer
+unsigned char readDirEntry(unsigned long adr, unsigned char *ent)
 {
-	unsigned char ch;
 	unsigned char i;
-	char str[5];
-	char filebase[8], btfbase[8];
-	unsigned char btfExists, choosen;
 
-	inited = 0;
-	PORTB = 0b00110000;	// red LED on
+	cmdFast(16, 32);
+	if (!cmd17Fast(adr)) {
+		memset(ent, 0, 32);
+		return 0;
+	}
+	for (i = 0; i < 32; i++) ent[i] = readByteFast();
+	readByteFast(); readByteFast(); // discard CRC bytes
+	return 1;
+}
 
-	// initialize the SD card
-	PORTD = NCLKNDI_CS;
-	for (i = 0; i != 200; i++) {
-		PORTD = _CLK_DI_CS;
-		wait5(WAIT);
-		PORTD = NCLK_DI_CS;
-		wait5(WAIT);
-	 }	// input 200 clock
- 	PORTD = NCLKNDINCS;
-	
-	cmd_(0, 0);	// command 0
- 	do {	
-		if (bit_is_set(PIND, 3)) return;												// Carto removido
-		ch = readByteSlow();
-	} while (ch != 0x01);
+/******************************************************************************/
+// mount the last image again if the card and its directory entry match
+// the EEPROM cache: no BPB, directory search or BTF update is needed
+unsigned char loadMount(unsigned char *cid, char *filebase)
+{
+	struct mountCache *mc = (struct mountCache *)writeData;
+	struct mruEntry *m;
+
+	btfEnt = 0;																		// BTF not read
+	eeprom_read_block(mc, &eeMount, sizeof(struct mountCache));
+	if ((mc->valid != MOUNT_VALID) || (memcmp(mc->cid, cid, 16) != 0)) return 0;
+	eeprom_read_block(mru, eeMru, sizeof(mru));
+	if ((mc->cur >= MRU_NUM) || (mru[mc->cur].age == 0xff)) return 0;
+	m = &mru[mc->cur];
+	if (!mruValid(mc->cur)) return 0;
+
+	fatAddr = mc->fatAddr;
+	rootAddr = mc->rootAddr;
+	userAddr = mc->userAddr;
+	sectorsPerCluster = mc->sectorsPerCluster;
+	sectorsPerCluster2 = mc->sectorsPerCluster2;
+	sectorsPerFat = mc->sectorsPerFat;
+	clusterEnd = mc->clusterEnd;
+	useMru(mc->cur);
+	memcpy(filebase, m->name, 8);
+	return 1;
+}
 
-	PORTD = NCLKNDI_CS;
-	while (1) {
-		if (bit_is_set(PIND, 3))
-			return;
-		PORTD = NCLKNDINCS;
-		cmd_(55, 0);	// command 55
-		ch = getRespSlow();
-		if (ch == 0xff) return;
-		if (ch & 0xfe) continue;
-		// if (ch == 0x00) break;
-		PORTD = NCLKNDI_CS;
-		PORTD = NCLKNDINCS;
-		cmd_(41, 0);	// command 41	
-		if (!(ch = getRespSlow()))
+/******************************************************************************/
+// save the mounted image to the EEPROM cache (only changed bytes are written):
+// its MRU slot if it has one, else an empty or the oldest slot
+void saveMount(unsigned char *cid, char *filebase)
+{
+	struct mountCache *mc = (struct mountCache *)writeData;
+	struct mruEntry *m;
+	unsigned char *ent = dirEnt;
+	unsigned char i, k, old;
+
+	imageAddr(0);																	// fatNic = first window
+	if (!readDirEntry(nicEnt, ent) || SD_ABORT) return;
+	eeprom_read_block(mc, &eeMount, sizeof(struct mountCache));
+	eeprom_read_block(mru, eeMru, sizeof(mru));
+	if ((mc->valid != MOUNT_VALID) || (memcmp(mc->cid, cid, 16) != 0) ||
+		(mc->rootAddr != rootAddr) || (mc->userAddr != userAddr))					// another card (or formatted)
+		for (i = 0; i < MRU_NUM; i++) mru[i].age = 0xff;
+
+	for (i = k = 0; i < MRU_NUM; i++) {
+		if ((mru[i].age != 0xff) && (mru[i].ent == nicEnt) && (mru[i].disk == sdcDisk)) {	// J est na tabela
+			k = i;
+			accel = mru[k].accel;
 			break;
-		if (ch == 0xff)
-			return;
-		PORTD = NCLKNDI_CS;
+		}
+		if (mru[i].age > mru[k].age) k = i;											// Vazio (0xff) ou mais antigo
 	}
+	old = mru[k].age;
+	for (i = 0; i < MRU_NUM; i++)
+		if (mru[i].age < old) mru[i].age++;
+
+	m = &mru[k];
+	m->ent = nicEnt;
+	m->cluster = *(unsigned short *)(ent + 26);
+	m->attr = ent[11];
+	m->size = *(unsigned long *)(ent + 28);
+	memcpy(m->name, filebase, 8);
+	m->type = imageType;
+	m->clusters = imageClusters;
+	m->protect = protect;
+	m->contig = imageContig;
+	m->accel = accel;
+	m->disk = sdcDisk;
+	m->base = imageBase;
+	m->age = 0;
+	mruCur = k;
+
+	mc->valid = MOUNT_VALID;
+	memcp(mc->cid, cid, 16);
+	mc->fatAddr = fatAddr;
+	mc->rootAddr = rootAddr;
+	mc->userAddr = userAddr;
+	mc->sectorsPerCluster = sectorsPerCluster;
+	mc->sectorsPerCluster2 = sectorsPerCluster2;
+	mc->sectorsPerFat = sectorsPerFat;
+	mc->cur = k;
+	mc->clusterEnd = clusterEnd;
+	eeprom_update_block(mc, &eeMount, sizeof(struct mountCache));
+	eeprom_update_block(mru, eeMru, sizeof(mru));
+	eeprom_update_block(fatNic, eeMruFat[k], sizeof(fatNic));
+	cmdFast(16, (unsigned long)512);
+}
+
+/******************************************************************************/
+// mount the image of MRU slot (k) from the cache alone
+void useMru(unsigned char k)
+{
+	struct mruEntry *m = &mru[k];
+
+	nicEnt = m->ent;
+	imageType = m->type;
+	imageClusters = m->clusters;
+	protect = m->protect;
+	imageStart = m->cluster;
+	imageContig = m->contig;
+	accel = m->accel;
+	sdcDisk = m->disk;
+	imageBase = m->base;
+	eeprom_read_block(fatNic, eeMruFat[k], sizeof(fatNic));
+	prevFatNumNic = 0;
+	wozTrack = 0xff;
+	mruCur = k;
+}
+
+/******************************************************************************/
+// the image of MRU slot #(k) is still on the card as it was saved: the
+// name, attribute, start cluster and size of its directory entry match
+// (it may have been deleted or replaced on a PC since)
+unsigned char mruValid(unsigned char k)
+{
+	struct mruEntry *m = &mru[k];
+	unsigned char *ent = dirEnt, i;
+
+	i = readDirEntry(m->ent, ent);
+	cmdFast(16, (unsigned long)512);
+	if (!i || SD_ABORT) return 0;
+	return ((memcmp(ent, m->name, 8) == 0) && (ent[11] == m->attr) &&
+		(*(unsigned short *)(ent + 26) == m->cluster) &&
+		(*(unsigned long *)(ent + 28) == m->size));
+}
+
+/******************************************************************************/
+// drop MRU slot #(k): the newer ones keep their age, the older ones
+// move up, so the ages stay 0 - n-1
+void mruDrop(unsigned char k)
+{
+	unsigned char i, a = mru[k].age;
+
+	for (i = 0; i < MRU_NUM; i++)
+		if ((mru[i].age != 0xff) && (mru[i].age > a)) mru[i].age--;
+	mru[k].age = 0xff;
+	eeprom_update_block(mru, eeMru, sizeof(mru));
+}
+
+/******************************************************************************/
+// SD card address of the data of the BTF file (entry btfEnt), 0 if it has none
+unsigned long btfData(void)
+{
+	unsigned short cl;
+
+	cmdFast(16, 2);
+	cl = readWord(btfEnt + 26);
+	cmdFast(16, (unsigned long)512);
+	if ((cl < 2) || (cl > 0xfff6)) return 0;
+	return userAddr + ((unsigned long)(cl - 2) << sectorsPerCluster2) * 512;
+}
+
+/******************************************************************************/
+// read the record of the BTF file, 0 if it has none
+unsigned char btfRead(struct btfRec *b)
+{
+	unsigned long adr = btfData();
+	unsigned char i, ok;
+
+	if (adr == 0) return 0;
+	cmdFast(16, sizeof(struct btfRec));
+	ok = cmd17Fast(adr);
+	if (ok) {
+		for (i = 0; i < sizeof(struct btfRec); i++) ((unsigned char *)b)[i] = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	cmdFast(16, (unsigned long)512);
+	return ok && (memcmp(b->magic, BTF_MAGIC, 4) == 0);
+}
+
+/******************************************************************************/
+// write the record of the BTF file, 0 if it has no data to hold it
+unsigned char btfWrite(struct btfRec *b)
+{
+	unsigned long adr = btfData();
+
+	if (adr == 0) return 0;
+	memcpy(b->magic, BTF_MAGIC, 4);
+	return writeSD(adr, (unsigned char *)b, sizeof(struct btfRec));
+}
+
+/******************************************************************************/
+// read the volume, then find the image to mount: the BTF one, the chosen
+// one or the newest, converting a DSK image to NIC if needed
+unsigned char mountImage(unsigned char choose, char *filebase)
+{
+	unsigned char i;
+	char str[5];
+	char btfbase[8];
+	unsigned char btfExists, choosen;
+	unsigned short n, dir, btfDir, btfDisk;
+	struct btfRec b;
 
 	// BPB address
 	cmdFast(16, 5);
-	cmd17Fast(54);
+	if (!cmd17Fast(54)) return 0;
 	for (i = 0; i < 5; i++)
 		str[i] = readByteFast();
 	readByteFast(); readByteFast(); // discard CRC
@@ -1138,7 +2092,7 @@ void init(unsigned char choose)
 		bpbAddr = 0;
 	} else {
 		cmdFast(16, 4);
-		cmd17Fast((unsigned long)0x1c6);
+		if (!cmd17Fast((unsigned long)0x1c6)) return 0;
 		bpbAddr = readByteFast();
 		bpbAddr += (unsigned long)readByteFast()*0x100;
 		bpbAddr += (unsigned long)readByteFast()*0x10000;
@@ -1146,14 +2100,14 @@ void init(unsigned char choose)
 		bpbAddr *= 512;
 		readByteFast(); readByteFast(); // discard CRC bytes
 	}
-	if (bit_is_set(PIND, 3)) return;
+	if (SD_ABORT) return 0;
 
 	// sectorsPerCluster and reservedSectors
 	{
 		unsigned short reservedSectors;
 		volatile unsigned char k;
 		cmdFast(16, 3);
-		cmd17Fast(bpbAddr + 0x0D);
+		if (!cmd17Fast(bpbAddr + 0x0D)) return 0;
 		sectorsPerCluster = k = readByteFast();
 
 		sectorsPerCluster2 = 0;
@@ -1169,12 +2123,12 @@ void init(unsigned char choose)
 		// reservedSectors = 2 at 2GB
 		fatAddr = bpbAddr + (unsigned long)512*reservedSectors;
 	}
-	if (bit_is_set(PIND, 3)) return;
+	if (SD_ABORT) return 0;
 
 	{
 		// sectorsPerFat and rootAddr
 		cmdFast(16, 2);
-		cmd17Fast(bpbAddr +0x16);
+		if (!cmd17Fast(bpbAddr +0x16)) return 0;
 		sectorsPerFat = readByteFast();
 		sectorsPerFat += (unsigned short)readByteFast() * 0x100;
 		readByteFast(); readByteFast(); // discard CRC bytes
@@ -1182,16 +2136,51 @@ void init(unsigned char choose)
 		rootAddr = fatAddr + ((unsigned long)sectorsPerFat * 2 * 512);
 		userAddr = rootAddr+(unsigned long)512 * 32;
 	}
-	if (bit_is_set(PIND, 3)) return;
+	if (SD_ABORT) return 0;
 
-	// find "BTF" boot file
-	btfDir = findExt("BTF", (unsigned char *)0, btfbase, 0);
-	btfExists = (btfDir != 512);
+	{
+		// clusterEnd: the total sectors (16-bit, or 32-bit if 0) less
+		// those before the data area, in clusters from cluster 2
+		unsigned long total;
+		cmdFast(16, 17);
+		if (!cmd17Fast(bpbAddr + 0x13)) return 0;
+		total = readByteFast();
+		total += (unsigned short)readByteFast() * 0x100;
+		for (i = 0; i < 11; i++) readByteFast();
+		if (total == 0) {
+			total = readByteFast();
+			total += (unsigned long)readByteFast()*0x100;
+			total += (unsigned long)readByteFast()*0x10000;
+			total += (unsigned long)readByteFast()*0x1000000;
+		} else for (i = 0; i < 4; i++) readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+		n = (userAddr - bpbAddr) / 512;
+		total = ((total > n) ? ((total - n) >> sectorsPerCluster2) : 0) + 2;
+		clusterEnd = ((total > 0xfff0) ? 0xfff0 : total);
+	}
+	if (SD_ABORT) return 0;
+
+	// find "BTF" boot file in the root, its record keeps the directory
+	// of the image and the disk of an SDC container
+	setDir(0);
+	n = findExt("BTF", (unsigned char *)0, btfbase, 0);
+	btfExists = (n != 512);
+	btfEnt = 0;
+	btfDir = btfDisk = 0;
+	if (btfExists) {
+		btfEnt = dirAddr(n);
+		if (btfRead(&b)) {
+			if ((b.dir >= 2) && (b.dir <= 0xfff6)) btfDir = b.dir;
+			btfDisk = b.disk;
+		}
+		setDir(btfDir);
+	}
 
 	// choose a NIC file from a NIC file list
 	if (choose) {
-		choosen = chooseANicFile(&writeData[0][0], btfExists, btfbase);
+		choosen = chooseANicFile(writeData, btfExists, btfbase);
 	} else choosen = 0;
+	if (!choosen) sdcDisk = btfDisk;
 
 	lcd_clear();
 	lcd_puts_p(MSG7);
@@ -1199,141 +2188,998 @@ void init(unsigned char choose)
 	if (btfExists || choosen)
 		memcpy(filebase, btfbase, 8);
 
-	// find "NIC" extension
-	nicDir = findExt("NIC", &protect, filebase, btfExists || choosen);
+#ifdef SMARTPORT
+	// find "PO", "2MG" or "HDV" block images
+	imageType = IMG_PO;
+	n = findExt("PO ", &protect, filebase, btfExists || choosen);
+	if (n == 512) {
+		imageType = IMG_2MG;
+		n = findExt("2MG", &protect, filebase, btfExists || choosen);
+	}
+	if (n == 512) {
+		imageType = IMG_PO;
+		n = findExt("HDV", &protect, filebase, btfExists || choosen);
+	}
+	if (n == 512) return 0;
+	nicEnt = dirAddr(n);
+	sdcDisk = 0;
+	if (!openImage()) return 0;
+#else
+	// a disk of an SDC container, else "NIC", raw "NIB" and "WOZ"
+	// tracks, else the first disk of a container
+	n = 512;
+	if (sdcDisk)
+		n = findExt(SDC_EXT, &protect, filebase, btfExists || choosen);
+	if (n == 512) {
+		sdcDisk = 0;
+		imageType = IMG_NIC;
+		n = findExt("NIC", &protect, filebase, btfExists || choosen);
+	}
+	if (n == 512) {
+		imageType = IMG_NIB;
+		n = findExt("NIB", &protect, filebase, btfExists || choosen);
+	}
+	if (n == 512) {
+		imageType = IMG_WOZ;
+		n = findExt("WOZ", &protect, filebase, btfExists || choosen);
+	}
+	if (n == 512) {
+		sdcDisk = 1;
+		n = findExt(SDC_EXT, &protect, filebase, btfExists || choosen);
+	}
 
-	if (nicDir == 512) { // create NIC file if not exists
+	if (n == 512) { // create NIC file if not exists
+		sdcDisk = 0;
+		imageType = IMG_NIC;
 		// find "DSK" extension
-		dskDir = findExt("DSK", (unsigned char *)0, filebase, btfExists);
-		if (dskDir == 512) return;
-		if (!createFile(filebase, "NIC", (unsigned short)560)) return;
-		nicDir = findExt("NIC", &protect, filebase, btfExists);
-		if (nicDir == 512) return;
-		// convert DSK image to NIC image
-		dsk2Nic();
+		n = findExt("DSK", (unsigned char *)0, filebase, btfExists);
+		if (n == 512) return 0;
+		dskEnt = dirAddr(n);
+		if (!createFile(filebase, "NIC", (unsigned short)560)) {
+			lcd_clear();
+			lcd_puts_p(MSG15);
+			return 0;
+		}
+		n = findExt("NIC", &protect, filebase, btfExists);
+		if (n == 512) return 0;
+		nicEnt = dirAddr(n);
+		if (!openImage()) return 0;
+		// convert DSK image to NIC image; if that failed, remove the half
+		// written NIC, so the next mount converts the DSK again
+		if (!dsk2Nic()) {
+			removeFile(nicEnt);
+			lcd_clear();
+			lcd_puts_p(MSG16);
+			return 0;
+		}
+	} else {
+		nicEnt = dirAddr(n);
+		if (!openImage()) return 0;
 	}
-	if (bit_is_set(PIND, 3)) return;
+#endif
+	if (SD_ABORT) return 0;
 
-	// create "BTF" file if not exist
+	// create "BTF" file in the root if not exist, with a block for its
+	// record (not written yet)
 	if (!btfExists) {
-		createFile(filebase, "BTF", (unsigned short)0);
-		btfDir = findExt("BTF", (unsigned char *)0, filebase, 1);
-		btfExists = (btfDir != 512);
+		dir = curDir;
+		setDir(0);
+		createFile(filebase, "BTF", (unsigned short)1);
+		n = findExt("BTF", (unsigned char *)0, filebase, 1);
+		btfExists = (n != 512);
+		if (btfExists) btfEnt = dirAddr(n);
+		btfDir = 0xffff;
+		setDir(dir);
 	}
 
-	// rewrite the file name part of "BTF"
+	// rewrite the file name and the record of "BTF"
 	if (btfExists && (choosen || (memcmp(filebase, btfbase, 8) != 0))) {
-		writeSD(rootAddr + btfDir * 32, (unsigned char *)filebase, 8);
-		duplicateFat();
+		writeSD(btfEnt, (unsigned char *)filebase, 8);
+	}
+	if (btfExists && ((btfDir != curDir) || (btfDisk != sdcDisk))) {
+		b.dir = curDir;
+		b.disk = sdcDisk;
+		if (!btfWrite(&b)) {														// No data: make it again with some
+			dir = curDir;
+			setDir(0);
+			removeFile(btfEnt);
+			createFile(filebase, "BTF", (unsigned short)1);
+			n = findExt("BTF", (unsigned char *)0, filebase, 1);
+			btfExists = (n != 512);
+			if (btfExists) btfEnt = dirAddr(n);
+			setDir(dir);
+			if (btfExists) btfWrite(&b);
+		}
+	}
+	return 1;
+}
+
+#ifdef TRACE
+/******************************************************************************/
+// find (or create) SDISK2.TRC in the root; the trace is written from its
+// start at every mount, and not at all if the file is fragmented
+void trcOpen(void)
+{
+	unsigned long adr;
+	unsigned short n, cl;
+
+	trcAddr = trcPos = 0;
+	trcCount = trcLost = trcStream = 0;
+	trcTrk = 0xff;
+	setDir(0);
+	n = findExt(TRC_EXT, (unsigned char *)0, TRC_NAME, 1);
+	if (n == 512) {
+		if (!createFile(TRC_NAME, TRC_EXT, TRC_SECTORS)) return;
+		n = findExt(TRC_EXT, (unsigned char *)0, TRC_NAME, 1);
+		if (n == 512) return;
+	}
+	adr = dirAddr(n);
+	cmdFast(16, 2);
+	cl = readWord(adr + 26);														// Cluster inicial
+	trcSize = readWord(adr + 28) + ((unsigned long)readWord(adr + 30) << 16);	// Tamanho
+	trcSize &= ~0x1ffUL;
+	if (cl < 2) return;
+	fatBufSector = 0xffff;
+	fatBufDirty = 0;
+	for (n = 1; n < ((trcSize >> 9) + sectorsPerCluster - 1) >> sectorsPerCluster2; n++)
+		if (readFat(cl + n - 1) != cl + n) return;									// Fragmentado
+	trcAddr = userAddr + ((unsigned long)(cl - 2) << sectorsPerCluster2) * 512;
+	cmdFast(16, (unsigned long)512);
+}
+
+/******************************************************************************/
+// add a record to the trace ring, called with the Disk II interrupts off
+// (or from INT0); when the ring is full the records are only counted
+void trcEvent(unsigned char type, unsigned char a, unsigned char b)
+{
+	unsigned char *p;
+
+	if (trcLost && (trcCount <= TRC_RING - 2 * TRC_REC)) {
+		p = trcBuf + trcCount;
+		p[0] = TRC_LOST;
+		p[1] = trcLost;
+		p[2] = 0;
+		p[3] = 0;
+		trcCount += TRC_REC;
+		trcLost = 0;
+	}
+	if (trcCount > TRC_RING - TRC_REC) {
+		if (trcLost != 0xff) trcLost++;
+		return;
+	}
+	p = trcBuf + trcCount;
+	p[0] = type;
+	p[1] = a;
+	p[2] = b;
+	p[3] = trcStream;
+	trcCount += TRC_REC;
+	trcStream = 0;
+}
+
+/******************************************************************************/
+// append the ring to SDISK2.TRC, while the drive is disabled and the
+// journal is empty, so the journal is the sector buffer
+void trcFlush(void)
+{
+	unsigned char *buf = jrnBuf(0);
+	unsigned char i = 0;
+	unsigned short ofs, j;
+	unsigned long adr;
+
+	while ((i < trcCount) && trcAddr && (trcPos < trcSize)) {
+		if (SD_ABORT) return;														// Carto foi removido
+		ofs = (trcPos & 0x1ff);
+		adr = trcAddr + trcPos - ofs;
+		if (ofs) {																	// Setor j comeado
+			cmdFast(16, 512);
+			if (!cmd17Fast(adr)) return;
+			for (j = 0; j < 512; j++) buf[j] = readByteFast();
+			readByteFast(); readByteFast(); // discard CRC bytes
+		}
+		for (; (i < trcCount) && (ofs < 512); i++, ofs++, trcPos++) buf[ofs] = trcBuf[i];
+		for (j = ofs; j < 512; j++) buf[j] = 0;										// Fim do trace
+		writeBlock(adr, buf);
+	}
+	if (i < trcCount) {															// Arquivo cheio (ou ausente)
+		i = (trcCount - i) / TRC_REC;
+		trcLost = (trcLost + i > 0xff) ? 0xff : trcLost + i;
+	}
+	trcCount = 0;
+}
+#endif
+
+/******************************************************************************/
+// initialization called from check_eject
+void init(unsigned char choose)
+{
+	unsigned char ch;
+	unsigned char i;
+	unsigned short n;
+	char filebase[8];
+	unsigned char cid[16];
+
+	DISK_INT_OFF;		// may be entered mounted (sdcSwitch)
+	inited = 0;
+	PORTB = 0b00110000;	// red LED on
+	EIFR = (1<<INTF1);
+	sdAbort = bit_is_set(PIND, 3);
+
+	// initialize the SD card
+	PORTD = NCLKNDI_CS;
+	for (i = 0; i != 200; i++) {
+		PORTD = _CLK_DI_CS;
+		wait5(WAIT);
+		PORTD = NCLK_DI_CS;
+		wait5(WAIT);
+	 }	// input 200 clock
+ 	PORTD = NCLKNDINCS;
+	
+	cmd_(0, 0);	// command 0
+	i = SD_RESP_WAIT;
+ 	do {	
+		if (SD_ABORT) return;															// Carto removido
+		ch = readByteSlow();
+		if (!--i) return;																// Sem resposta: tenta de novo depois
+	} while (ch != 0x01);
+
+	PORTD = NCLKNDI_CS;
+	for (n = 0; ; n++) {
+		if (SD_ABORT || (n == SD_INIT_WAIT))
+			return;
+		PORTD = NCLKNDINCS;
+		cmd_(55, 0);	// command 55
+		ch = getRespSlow();
+		if (ch == 0xff) return;
+		if (ch & 0xfe) continue;
+		// if (ch == 0x00) break;
+		PORTD = NCLKNDI_CS;
+		PORTD = NCLKNDINCS;
+		cmd_(41, 0);	// command 41	
+		if (!(ch = getRespSlow()))
+			break;
+		if (ch == 0xff)
+			return;
+		PORTD = NCLKNDI_CS;
+	}
+
+	// same card and image as last time: mount from the EEPROM cache,
+	// not if the card did not tell who it is
+	ch = readCid(cid);
+	if (SD_ABORT) return;
+	if (!ch || choose || !loadMount(cid, filebase)) {
+		accel = 0;
+		if (!mountImage(choose, filebase)) return;
+		if (ch) saveMount(cid, filebase);
 	}
+#ifdef SMARTPORT
+	if (!spOpen()) return;
+#endif
 
 	// display file name
 	lcd_clear();
-	dispStr(filebase, 0);
+	dispImage(filebase);
+#ifdef TRACE
+	trcOpen();
+	TRC(TRC_MOUNT, imageType | (imageContig ? 0x80 : 0) | (accel ? 0x40 : 0), sectorsPerCluster2);
+#endif
 
-	prevFatNumNic = 0xff;
 	prevFatNumDsk = 0xff;
-	bitbyte = 0;
+	bitbyte = 514 * 8;
 	readPulse = 0;
 	magState = 0;
 	prepare = 1;
 	ph_track = 0;
+	headTrk = 0;
 	sector = 0;
 	buffNum = 0;
 	formatting = 0;
-	writePtr = &(writeData[buffNum][0]);
+	sdErrors = 0;
+	writePtr = capBuf(buffNum);
 	cmdFast(16, (unsigned long)512);
+	partRead = 0;
+	fieldTrk = 0xff;																// check the tracks again
 	buffClear();
 	inited = 1;
 }
 
 /******************************************************************************/
-// called when the card is inserted or removed
+// switch the accelerated mode of the mounted NIC image and keep it
+// with the image in the EEPROM cache
+void toggleAccel(void)
+{
+	if (imageType != IMG_NIC) return;											// raw tracks: timing matters
+	DISK_INT_OFF;
+	cancelRead();
+	accel ^= 1;
+	PORTD = NCLKNDI_CS;															// LCD shares DI and CLK
+	lcd_gotoxy(0, 0);
+	lcd_puts_p(accel ? MSG9 : MSG10);
+	PORTD = NCLKNDINCS;
+	mru[mruCur].accel = accel;
+	eeprom_update_byte(&eeMru[mruCur].accel, accel);
+	prepare = 1;
+	DISK_INT_ON;
+}
+
+/******************************************************************************/
+// swap to the next older (or newer) image of the MRU table: only its
+// directory entry is read (a slot that no longer matches is dropped),
+// not the FAT or the BTF, so a swap takes milliseconds
+void swapImage(unsigned char older)
+{
+	unsigned char i, n, a;
+
+	DISK_INT_OFF;
+	cancelRead();
+	prepare = 1;
+	for (;;) {
+		for (i = n = 0; i < MRU_NUM; i++)
+			if (mru[i].age != 0xff) n++;
+		a = mru[mruCur].age;
+		if (older) a = ((a + 1 >= n) ? 0 : a + 1);
+		else a = (a ? a - 1 : n - 1);
+		for (i = 0; (i < MRU_NUM) && (mru[i].age != a); i++) ;
+		if ((n < 2) || (i == MRU_NUM) || SD_ABORT) {
+			DISK_INT_ON;
+			return;
+		}
+		if (mruValid(i)) break;
+		mruDrop(i);																// deleted or replaced on a PC
+	}
+	if (wCount || capQueued())												// the last writes go to the old image
+		writeBackSub();
+	useMru(i);
+	btfEnt = 0;																// the BTF names another image
+	eeprom_update_byte(&eeMount.cur, i);
+#ifdef SMARTPORT
+	if (!spOpen()) inited = 0;
+#endif
+	TRC(TRC_MOUNT, imageType | (imageContig ? 0x80 : 0) | (accel ? 0x40 : 0), sectorsPerCluster2);
+	fieldTrk = 0xff;																// check the tracks again
+	buffClear();
+	bitbyte = 514 * 8;
+	sector = 0;
+	prepare = 1;
+	dispImage(mru[i].name);
+	DISK_INT_ON;
+}
+
+/******************************************************************************/
+// show the mounted image: (name), or for a disk of an SDC container the
+// name in its index record
+void dispImage(char *name)
+{
+	char s[8];
+
+	if (sdcDisk) {
+		if (!sdcRead(imageStart, sdcDisk, (unsigned char *)s, 8)) memset(s, ' ', 8);
+		name = s;
+	}
+	PORTD = NCLKNDI_CS;															// LCD shares DI and CLK
+	dispStr(name, 0);
+	if (accel) {
+		lcd_gotoxy(0, 0);
+		lcd_puts_p(MSG9);
+	}
+	PORTD = NCLKNDINCS;
+}
+
+/******************************************************************************/
+// ENTER while a disk of an SDC container is mounted: choose another disk
+// of it, which only changes imageBase (no directory, FAT or BPB read);
+// 0 if ".." was chosen, to choose from the directory instead
+unsigned char sdcSwitch(void)
+{
+	unsigned short n;
+	unsigned char cid[16];
+	struct btfRec b;
+
+	DISK_INT_OFF;
+	cancelRead();
+	if (wCount || capQueued())												// the last writes go to the old disk
+		writeBackSub();
+	n = sdcChoose(imageStart, sdcDisk);
+	if (n == 0) {
+		prepare = 1;
+		DISK_INT_ON;
+		return 0;
+	}
+	sdcDisk = n;
+	protect = ((mru[mruCur].attr & 1) << 3);
+	if (!sdcSelect() || SD_ABORT) {
+		inited = 0;
+		return 1;
+	}
+	if (imageType != IMG_NIC) protect = 0x08;									// Trilhas cruas: somente leitura
+	wozTrack = 0xff;
+	accel = 0;
+	if (readCid(cid)) saveMount(cid, mru[mruCur].name);
+	if (btfEnt && btfRead(&b)) {
+		b.disk = sdcDisk;
+		btfWrite(&b);
+	}
+	TRC(TRC_MOUNT, imageType | (imageContig ? 0x80 : 0) | (accel ? 0x40 : 0), sectorsPerCluster2);
+	fieldTrk = 0xff;																// check the tracks again
+	buffClear();
+	bitbyte = 514 * 8;
+	sector = 0;
+	prepare = 1;
+	lcd_clear();
+	dispImage(mru[mruCur].name);
+	DISK_INT_ON;
+	return 1;
+}
+
+/******************************************************************************/
+// smallest gap the stack has left above the static data since reset:
+// sub.S paints it with STACK_PAINT before main, the deepest chains
+// (init, dsk2Nic, prepareFat; INT0, writeBack, writeBackSub2; PCINT0,
+// which nests on any of them) eat into it
+unsigned short stackFree(void)
+{
+	extern unsigned char _end;													// end of .data, .bss and .noinit
+	unsigned char *p = &_end;
+
+	while ((p < (unsigned char *)SP) && (*p == STACK_PAINT)) p++;
+	return (p - &_end);
+}
+
+/******************************************************************************/
+// SRAM diagnostics screen (ENTER with UP): static data and the stack
+// high water mark, until a button is pushed
+void showSram(void)
+{
+	extern unsigned char _end;
+
+	DISK_INT_OFF;
+	cancelRead();
+	PORTD = NCLKNDI_CS;															// LCD shares DI and CLK
+	lcd_clear();
+	lcd_puts_p(MSG12);
+	lcd_gotoxy(12, 0);
+	lcd_dec(&_end - (unsigned char *)RAMSTART);
+	lcd_gotoxy(0, 1);
+	lcd_puts_p(MSG13);
+	lcd_gotoxy(12, 1);
+	lcd_dec(stackFree());
+	while (keys & (KEY_ENTER | KEY_UP)) inputPoll();
+	while (!(inputEvents() & (KEY_ENTER | KEY_UP | KEY_DOWN)))
+		if (!(keys & KEY_CARD)) break;											// Carto removido
+	while (keys & (KEY_ENTER | KEY_UP | KEY_DOWN)) inputPoll();
+	lcd_clear();
+	if (inited) {
+		dispStr(mru[mruCur].name, 0);
+		if (accel) {
+			lcd_gotoxy(0, 0);
+			lcd_puts_p(MSG9);
+		}
+	}
+	PORTD = NCLKNDINCS;
+	prepare = 1;
+	if (inited) DISK_INT_ON;
+}
+
+/******************************************************************************/
+// debounced inputs start as they are at power on, an inserted card counts
+// as just inserted; Timer2 ticks at TICK_HZ (CTC, F_CPU / 1024)
+void inputInit(void)
+{
+	TCCR2A = (1<<WGM21);
+	TCCR2B = (1<<CS22) | (1<<CS21) | (1<<CS20);
+	OCR2A = F_CPU / 1024 / TICK_HZ - 1;
+	keys = 0;
+	if (bit_is_clear(PIND, 3)) keys |= KEY_CARD;
+	if (bit_is_clear(ENTER_PIN, ENTER_BIT)) keys |= KEY_ENTER;
+	if (bit_is_clear(PIND, 7)) keys |= KEY_DOWN;
+	if (bit_is_clear(PINB, 5)) keys |= KEY_UP;
+	keyRaw = keys;
+	keyCount = KEY_DEBOUNCE;
+	keyEvents = keys & KEY_CARD;
+}
+
+/******************************************************************************/
+// sample the inputs when a tick is due: the Timer2 flag is polled, so no
+// interrupt can delay the Disk II streaming; an input change is taken
+// once all inputs have been stable for KEY_DEBOUNCE ticks, a held UP or
+// DOWN repeats its press
+void inputPoll(void)
+{
+	unsigned char raw = 0;
+
+	if (!(TIFR2 & (1<<OCF2A))) return;
+	TIFR2 = (1<<OCF2A);
+	ticks++;
+	if (bit_is_clear(PIND, 3)) raw |= KEY_CARD;
+	if (bit_is_clear(ENTER_PIN, ENTER_BIT)) raw |= KEY_ENTER;
+	if (bit_is_clear(PIND, 7)) raw |= KEY_DOWN;
+	if (bit_is_clear(PINB, 5)) raw |= KEY_UP;
+	if (raw != keyRaw) {
+		keyRaw = raw;
+		keyCount = 0;
+	} else if (keyCount < KEY_DEBOUNCE) {
+		if (++keyCount == KEY_DEBOUNCE) {
+			keyEvents |= raw & ~keys;
+			keys = raw;
+			keyRepeat = KEY_REPEAT_DELAY;
+		}
+	} else if ((keys & (KEY_UP | KEY_DOWN)) && !--keyRepeat) {
+		keyEvents |= keys & (KEY_UP | KEY_DOWN);
+		keyRepeat = KEY_REPEAT_RATE;
+	}
+}
+
+/******************************************************************************/
+// take the press events since the last call
+unsigned char inputEvents(void)
+{
+	unsigned char ev;
+
+	inputPoll();
+	ev = keyEvents;
+	keyEvents = 0;
+	return ev;
+}
+
+/******************************************************************************/
+// called on every main loop turn: acts on the card detect and the button
+// events, never waits for an input
 void check_eject(void)
 {
-	unsigned long i;
-	static unsigned char f = 1;
+	static unsigned char f = 1, held = 0, tried;
+	unsigned char ev = inputEvents();
 
-	if (bit_is_set(PIND, 3)) {
-		for (i = 0; i != 0x50000; i++)
-			if (bit_is_clear(PIND, 3)) return;
+	if (!(keys & KEY_CARD)) {
 		// SD card removed !
-		TIMSK0 &= ~(1<<TOIE0);
-		EIMSK &= ~(1<<INT0);
+		DISK_INT_OFF;
 		inited = 0;
 		prepare = 0;
+		held = 0;
 		if (f) {
 			lcd_clear();
 			lcd_puts_p(MSG8);
 			f = 0;
 		}
-	} else if (bit_is_clear(PIND, 6) && bit_is_set(PINC, 0)) { // drive disabled
-		unsigned char flg = 1;
-
-		for (i = 0; i != 100; i++)
-			if (bit_is_set(PIND,6))
-				flg = 0;
-		if (flg) {
-			while (bit_is_clear(PIND, 6))
-				nop();
+		return;
+	}
+	if (bit_is_set(PINC, 0)) { // drive disabled
+		if (ev & KEY_ENTER) {
+			held = 0;
+			if (keys & KEY_UP) {
+				showSram();		// ENTER with UP: SRAM diagnostics
+				return;
+			}
 			// enter button pushed !
 			cli();
-			init(1);
-			if (inited) {
-				TIMSK0 |= (1<<TOIE0);
-				EIMSK |= (1<<INT0);
-			}
+			if (!inited || !sdcDisk || !sdcSwitch())		// another disk of the container, or any image
+				init(1);
+			if (inited) DISK_INT_ON;
 			sei();
+			return;
 		}
-	} else if (!inited) { // if not initialized
-		for (i = 0; i != 0x50000; i++) {
-			if (bit_is_set(PIND, 3)) return;
+		if (inited) {
+			held |= keys & (KEY_UP | KEY_DOWN);
+			if (held && !(keys & (KEY_UP | KEY_DOWN))) {		// UP or DOWN released
+				if (held == (KEY_UP | KEY_DOWN))
+					toggleAccel();		// UP and DOWN pushed together !
+				else
+					swapImage(held & KEY_UP);		// UP: older image, DOWN: newer image
+				held = 0;
+			}
 		}
+	} else held = 0;
+	if (!inited && ((ev & KEY_CARD) || ((unsigned char)(ticks - tried) >= INIT_RETRY))) { // if not initialized
 		// SD card inserted !
+		tried = ticks;
 		cli();
 		init(0);
-		if (inited) {
-			TIMSK0 |= (1<<TOIE0);
-			EIMSK |= (1<<INT0);
-		}
+		if (inited) DISK_INT_ON;
 		sei();
 		f = 1;
 	}
 }
 
-int main(void)
+/******************************************************************************/
+// card removed (PD3 rising): every SD loop gives up at its next command
+// or block instead of polling PD3 for each byte
+ISR(INT1_vect)
+{
+	sdAbort = 1;
+}
+
+/******************************************************************************/
+// head stepper movement, decoded on every change of PHASE-0..3 (PCINT0-3);
+// the sector being played is dropped as soon as the head leaves its track
+// (trackChanged, taken by the main loop), and the next one is read from the
+// track the head is stepping onto. Interrupts are enabled again once it
+// has masked itself: Timer0 and INT0 are cycle counted and must not wait
+// for this one, which takes a change made meanwhile in its loop
+ISR(PCINT0_vect)
+{
+	unsigned char stp, ofs, bt, trk;
+
+	PCICR = 0;
+	sei();
+	while (!bit_is_set(PINC, 0)) {											// drive enabled
+		stp = (PINB & 0b00001111);
+		if (stp == oldStp) break;
+		oldStp = stp;
+		ofs =
+			((stp==0b00001000) ? 2 :
+			((stp==0b00000100) ? 4 :
+			((stp==0b00000010) ? 6 :
+			((stp==0b00000001) ? 0 : 0xff))));
+		if (ofs == 0xff) continue;
+		ofs = ((ofs+ph_track)&7);
+		bt = pgm_read_byte_near(stepper_table + (ofs >> 1));
+		if (ofs & 1)
+			bt &= 0x0f;
+		else
+			bt >>= 4;
+		if (!bt) continue;
+		ph_track += ((bt & 0x08) ? (0xf8 | bt) : bt);
+		if (ph_track > 196)
+			ph_track = 0;
+		if (ph_track > 139)
+			ph_track = 139;
+		// moving in, a position between two tracks belongs to the next one
+		trk = ((bt & 0x08) ? ph_track : (ph_track + 3)) >> 2;
+		if (trk > 34)
+			trk = 34;
+		if (trk != headTrk) {
+			headTrk = trk;
+			trackChanged = 1;
+			prepare = 1;													// stop playing the old sector now
+		}
+	}
+	cli();																		// reti enables them again
+	PCICR = (1<<PCIE0);
+}
+
+#ifdef SMARTPORT
+/******************************************************************************/
+// block count of the mounted image, and where its blocks start: after the
+// header of a 2MG one (ProDOS order only); 0 if there is no block
+unsigned char spOpen(void)
+{
+	unsigned char *h = writeData;
+	unsigned long size, adr;
+	unsigned char i;
+
+	if (!readDirEntry(nicEnt, h)) return 0;
+	size = *(unsigned long *)(h + 28);
+	spOffset = 0;
+	if (imageType == IMG_2MG) {
+		adr = imageAddr(0);
+		cmdFast(16, 32);
+		if (!cmd17Fast(adr)) return 0;
+		for (i = 0; i < 32; i++) h[i] = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+		if ((memcmp(h, "2IMG", 4) != 0) || (h[12] != 1)) return 0;				// Somente ordem ProDOS
+		if (h[19] & 0x80) protect = 0x08;										// Imagem travada
+		spOffset = *(unsigned long *)(h + 24);
+		size = *(unsigned long *)(h + 20) << 9;
+	}
+	cmdFast(16, (unsigned long)512);
+	size >>= 9;
+	spBlocks = ((size > 0xffff) ? 0xffff : size);
+	return (spBlocks != 0);
+}
+
+/******************************************************************************/
+// wait until (*pin & mask) is (val), about 100 ms at most; 0 on a time
+// out or a bus reset
+unsigned char spWait(volatile unsigned char *pin, unsigned char mask, unsigned char val)
+{
+	unsigned long i;
+
+	for (i = 0; i != SP_WAIT; i++) {
+		if ((*pin & mask) == val) return 1;
+		if (SP_RESET) return 0;
+	}
+	return 0;
+}
+
+/******************************************************************************/
+// receive a packet while REQ is high (the host writes it with WRITE
+// REQUEST low) and take it: ACK low until REQ drops; returns the bytes
+// stored from C3 to C8, 0 if none
+unsigned short spReceive(void)
+{
+	unsigned short n;
+
+	if (!spWait(&PIND, _BV(2), 0)) return 0;
+	n = spRecv(SP_BUF, SP_MAX);
+	SP_ACK_LO;
+	if (!spWait(&PINB, _BV(0), 0)) return 0;
+	return n;
+}
+
+/******************************************************************************/
+// send the packet built in SP_BUF when the host asks for it: ACK high
+// (ready), the host raises REQ, then ACK low until REQ drops
+void spReply(unsigned short len)
 {
-	static unsigned char oldStp = 0, stp; // stepper motor input
+	SP_ACK_HI;
+	if (!spWait(&PINB, _BV(0), _BV(0))) return;
+	spSend(SP_BUF, len);
+	SP_ACK_LO;
+	spWait(&PINB, _BV(0), 0);
+	SP_ACK_HI;
+}
+
+/******************************************************************************/
+// build a packet to the host in SP_BUF: sync bytes, header, (len) bytes
+// of (data) as the odd bytes then groups of 7, each behind a byte of
+// their MSBs, and the checksum of header and data; returns its length
+unsigned short spEncode(unsigned char type, unsigned char stat, unsigned char *data, unsigned short len)
+{
+	unsigned char *p = SP_BUF, *h;
+	unsigned char odd = len % 7, grp = len / 7;
+	unsigned char chk = 0, msb, i, j;
+	unsigned short k;
+
+	*p++ = 0xff; *p++ = 0x3f; *p++ = 0xcf; *p++ = 0xf3; *p++ = 0xfc; *p++ = 0xff;
+	*p++ = 0xc3;																// Incio do pacote
+	h = p;
+	*p++ = 0x80;																// Destino: o host
+	*p++ = 0x80 | spUnit;														// Origem
+	*p++ = 0x80 | type;
+	*p++ = 0x80;																// Aux
+	*p++ = 0x80 | stat;
+	*p++ = 0x80 | odd;
+	*p++ = 0x80 | grp;
+	for (i = 0; i < 7; i++) chk ^= h[i];
+	for (k = 0; k < len; k++) chk ^= data[k];
+	if (odd) {
+		for (i = 0, msb = 0x80; i < odd; i++) msb |= (data[i] & 0x80) >> (i + 1);
+		*p++ = msb;
+		for (i = 0; i < odd; i++) *p++ = data[i] | 0x80;
+		data += odd;
+	}
+	for (j = 0; j < grp; j++, data += 7) {
+		for (i = 0, msb = 0x80; i < 7; i++) msb |= (data[i] & 0x80) >> (i + 1);
+		*p++ = msb;
+		for (i = 0; i < 7; i++) *p++ = data[i] | 0x80;
+	}
+	*p++ = chk | 0xaa;															// Bits pares
+	*p++ = (chk >> 1) | 0xaa;													// Bits mpares
+	*p++ = 0xc8;																// Fim do pacote
+	*p++ = 0x00;
+	return (p - SP_BUF);
+}
 
+/******************************************************************************/
+// decode the data of the packet received in SP_BUF ((n) bytes from C3)
+// into (dst), at most (max) bytes; returns its length, 0xffff if it is
+// too long, cut or its checksum is wrong
+unsigned short spDecode(unsigned char *dst, unsigned short max, unsigned short n)
+{
+	unsigned char *p = SP_BUF + 1;
+	unsigned char odd = p[5] & 0x7f, grp = p[6] & 0x7f;
+	unsigned char chk = 0, msb, i, j;
+	unsigned short len = odd + (unsigned short)grp * 7;
+
+	if ((SP_BUF[0] != 0xc3) || (len > max) ||
+		(n < 11 + (odd ? odd + 1 : 0) + (unsigned short)grp * 8)) return 0xffff;
+	for (i = 0; i < 7; i++) chk ^= *p++;
+	if (odd) {
+		msb = *p++;
+		for (i = 0; i < odd; i++) chk ^= (*dst++ = (*p++ & 0x7f) | ((msb << (i + 1)) & 0x80));
+	}
+	for (j = 0; j < grp; j++) {
+		msb = *p++;
+		for (i = 0; i < 7; i++) chk ^= (*dst++ = (*p++ & 0x7f) | ((msb << (i + 1)) & 0x80));
+	}
+	if ((p[0] & 0x55) != (chk & 0x55)) return 0xffff;
+	if ((p[1] & 0x55) != ((chk >> 1) & 0x55)) return 0xffff;
+	return len;
+}
+
+/******************************************************************************/
+// read block (blk) of the mounted image into SP_BLK; a block behind a
+// 2MG header is not sector aligned and is read in two pieces
+unsigned char spReadBlock(unsigned long blk)
+{
+	unsigned long pos = spOffset + (blk << 9), adr;
+	unsigned short ofs = pos & 0x1ff, n = 512 - ofs, i;
+	unsigned char *d = SP_BLK;
+
+	if (blk >= spBlocks) return 0;
+	adr = imageAddr(pos >> 9) + ofs;
+	cmdFast(16, n);
+	if (!cmd17Fast(adr)) return 0;
+	for (i = 0; i < n; i++) *d++ = readByteFast();
+	readByteFast(); readByteFast(); // discard CRC bytes
+	if (ofs) {
+		adr = imageAddr((pos >> 9) + 1);
+		cmdFast(16, ofs);
+		if (!cmd17Fast(adr)) return 0;
+		for (i = 0; i < ofs; i++) *d++ = readByteFast();
+		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	cmdFast(16, (unsigned long)512);
+	return 1;
+}
+
+/******************************************************************************/
+// write SP_BLK to block (blk) of the mounted image
+unsigned char spWriteBlock(unsigned long blk)
+{
+	unsigned long pos = spOffset + (blk << 9), adr;
+	unsigned short ofs = pos & 0x1ff;
+
+	if (blk >= spBlocks) return 0;
+	adr = imageAddr(pos >> 9);
+	if (ofs) {																	// Dois pedaos, lendo cada setor
+		if (!writeSD(adr + ofs, SP_BLK, 512 - ofs) ||
+			!writeSD(imageAddr((pos >> 9) + 1), SP_BLK + 512 - ofs, ofs)) return 0;
+	} else {
+		cmdFast(16, (unsigned long)512);
+		writeBlock(adr, SP_BLK);
+	}
+	return 1;
+}
+
+/******************************************************************************/
+// SmartPort personality: serve the commands of the host (IIc, IIgs or
+// a Liron card) from the block image instead of streaming nibbles
+void spLoop(void)
+{
+	unsigned char cmd[9], *d = SP_BLK;
+	unsigned char type, stat, dest;
+	unsigned short n, len;
+	unsigned long blk;
+
+	while (1) {
+		check_eject();
+		SP_ACK_HI;																// the LCD shares PC3
+		if (SP_RESET) {															// Reset do barramento: perde o ID
+			spUnit = 0;
+			continue;
+		}
+		if (!inited || !SP_BUS || !SP_REQ) continue;
+
+		// command packet
+		n = spReceive();
+		dest = SP_BUF[1] & 0x7f;
+		if (!n || (spDecode(cmd, 9, n) == 0xffff) || ((SP_BUF[3] & 0x7f) != SP_PKT_CMD) ||
+			((cmd[0] == SP_INIT) ? (spUnit && (dest != spUnit)) : (dest != spUnit)))
+			continue;															// Pacote de outro dispositivo
+		PORTB = 0b00110000;														// red LED on
+		type = SP_PKT_STATUS;
+		stat = 0;
+		len = 0;
+		// parameters: count, buffer pointer (2), block number (3) or code
+		blk = cmd[4] | ((unsigned short)cmd[5] << 8) | ((unsigned long)cmd[6] << 16);
+		switch (cmd[0]) {
+		case SP_INIT:
+			spUnit = dest;
+			stat = 0x7f;														// 0xff: o ltimo da cadeia
+			break;
+		case SP_STATUS:
+			d[0] = (protect ? 0xbc : 0xf8);										// Bloco, leitura, gravao, online
+			d[1] = spBlocks & 0xff;
+			d[2] = spBlocks >> 8;
+			d[3] = 0;
+			if (cmd[4] == 0) len = 4;
+			else if (cmd[4] == 3) {												// DIB
+				d[4] = 8;
+				memcpy(d + 5, mru[mruCur].name, 8);
+				memset(d + 13, ' ', 8);
+				d[21] = 0x02;													// Disco rigido
+				d[22] = 0x00;
+				d[23] = 0x01;
+				d[24] = 0x00;
+				len = 25;
+			} else stat = SP_BADCTL;
+			break;
+		case SP_READBLOCK:
+			if (blk >= spBlocks) stat = SP_BADBLOCK;
+			else if (!spReadBlock(blk)) stat = SP_IOERROR;
+			else {
+				type = SP_PKT_DATA;
+				len = 512;
+			}
+			break;
+		case SP_WRITEBLOCK:
+			SP_ACK_HI;															// Pronto para o pacote de dados
+			if (!spWait(&PINB, _BV(0), _BV(0))) {
+				stat = SP_IOERROR;
+				break;
+			}
+			n = spReceive();
+			if (!n || (spDecode(d, 512, n) != 512)) stat = SP_IOERROR;
+			else if (protect) stat = SP_NOWRITE;
+			else if (blk >= spBlocks) stat = SP_BADBLOCK;
+			else if (!spWriteBlock(blk)) stat = SP_IOERROR;
+			break;
+		case SP_FORMAT:
+		case SP_CONTROL:
+			break;
+		default:
+			stat = SP_BADCMD;
+		}
+		spReply(spEncode(type, stat, d, len));
+		PORTB = 0b00100000;														// red LED off
+	}
+}
+#endif
+
+int main(void)
+{
 	/* 1 = OUT, 0 = IN */
 	DDRB = 0b00010000;	/* PB4 = LED */
+#ifdef HW_PULSE
+	DDRC = 0b00111000;  /* PC1 = ENTER, PC3 = WRITE PROTECT/LCD D5, PC4 = LCD RS, PC5 = LCD E */
+	DDRD = 0b01110010;  /* PD1 = SD CS, PD4 = SD DI/LCD D6, PD5 = READ PULSE/LCD D7, PD6 = SD SCK/LCD D4 */
+#else
 	DDRC = 0b00111010;  /* PC1 = READ PULSE/LCD D4, PC3 = WRITE PROTECT/LCD D5, PC4 = LCD RS, PC5 = LCD E */
 	DDRD = 0b00110010;  /* PD1 = SD CS, PD4 = SD DI/LCD D6, PD5 = SD SCK/LCD D7 */
+#endif
 
 	PORTB = 0b00110000; /* PB4=1 - Led Aceso */
 	PORTC = 0b00000010; /* PC4=0 - LCD RS, PC5=0 - LCD Desabilitado */
-	PORTD = 0b11000010; /* PD1=0 - SD Desabilitado */
+	PORTD = NCLKNDI_CS; /* PD1=0 - SD Desabilitado */
 
 	// timer interrupt
+#ifdef HW_PULSE
+	// fast PWM, TOP = OCR0A, one bit cell per period: OC0B (READ PULSE)
+	// is set on compare match and cleared at BOTTOM, the interrupt only
+	// chooses OCR0B
+	OCR0A = PULSE_TOP;
+	OCR0B = PULSE_NONE;
+	TCCR0A = (1<<COM0B1) | (1<<COM0B0) | (1<<WGM01) | (1<<WGM00);
+	TCCR0B = (1<<WGM02) | (1<<CS00);
+#else
 	OCR0A = 0;
 	TCCR0A = 0;
 	TCCR0B = 1;
+#endif
 
-	// int0 interrupt
+	// int0 interrupt (falling), int1 interrupt on card removal (rising)
 	MCUCR = 0b00000010;
-	EICRA = 0b00000010;
+	EICRA = 0b00001110;
+	EIMSK = (1<<INT1);
+	EIFR = (1<<INTF1);
+	sdAbort = bit_is_set(PIND, 3);
+
+#ifndef SMARTPORT
+	// pin change interrupt on PHASE-0..3
+	PCMSK0 = 0b00001111;
+	PCICR = (1<<PCIE0);
+#endif
+
+#ifdef TRACE
+	// timer1 time stamps the trace, F_CPU / 64
+	TCCR1A = 0;
+	TCCR1B = (1<<CS11) | (1<<CS10);
+#endif
+
+#ifdef WRITE_ICP
+	// WRITE (ADC2) against the bandgap, the comparator output into the
+	// timer1 input capture (noise canceler on), timer1 at F_CPU
+	ADCSRA = 0;
+	ADCSRB = (1<<ACME);
+	ADMUX = (1<<MUX1);
+	ACSR = (1<<ACBG) | (1<<ACIC);
+	TCCR1A = 0;
+	TCCR1B = (1<<ICNC1) | (1<<CS10);
+#endif
 
 	sector = 0;
 	inited = 0;
 	readPulse = 0;
 	protect = 0;
-	bitbyte = 0;
+	bitbyte = 514 * 8;
 	magState = 0;
 	prepare = 1;
 	ph_track = 0;
+	headTrk = 0;
+	trackChanged = 0;
+	oldStp = 0;
 	buffNum = 0;
 	formatting = 0;
-	writePtr = &(writeData[buffNum][0]);
+	writePtr = capBuf(buffNum);
 
 	lcd_init();
 	lcd_clear();
@@ -1341,93 +3187,147 @@ int main(void)
 	lcd_gotoxy(0, 1);
 	lcd_puts_p(MSG2);
 	_delay_ms(1000);
+	inputInit();
 
+#ifdef SMARTPORT
+	spLoop();
+#else
 	while (1) {
 		check_eject();
 		if (bit_is_set(PINC, 0)) {											// disable drive
 			PORTB = 0b00100000;												// red LED off
+#ifdef TRACE
+			if (inited && !trcIdle) {
+				trcIdle = 1;
+				TRC(TRC_IDLE, wCount + capQueued(), 0);
+			}
+#endif
+			if (inited && (wCount || capQueued())) {						// write the queued sectors
+				DISK_INT_OFF;
+				cancelRead();
+				writeBackSub();
+				prepare = 1;
+				DISK_INT_ON;
+			}
+#ifdef TRACE
+			if (inited && trcCount) {										// then the trace
+				DISK_INT_OFF;
+				cancelRead();
+				trcFlush();
+				prepare = 1;
+				DISK_INT_ON;
+			}
+#endif
 		} else {															// enable drive
 			PORTB = 0b00110000;
+#ifdef TRACE
+			trcIdle = 0;
+#endif
 			// protect = ((PIND&0b10000000)>>4);
-			stp = (PINB & 0b00001111);
-			if (stp != oldStp) {
-				oldStp = stp;
-				unsigned char ofs =
-					((stp==0b00001000) ? 2 :
-					((stp==0b00000100) ? 4 :
-					((stp==0b00000010) ? 6 :
-					((stp==0b00000001) ? 0 : 0xff))));
-				if (ofs != 0xff) {
-					ofs = ((ofs+ph_track)&7);
-					unsigned char bt = pgm_read_byte_near(stepper_table + (ofs >> 1));
-					oldStp = stp;
-					if (ofs & 1)
-						bt &= 0x0f;
-					else
-						bt >>= 4;
-					ph_track += ((bt & 0x08) ? (0xf8 | bt) : bt);
-					if (ph_track > 196)
-						ph_track = 0;
-					if (ph_track > 139)
-						ph_track = 139;
+			// head movement is tracked by the PCINT0 interrupt
+			if (inited && (prepare == 4)) {									// raw track: keep the ring ahead
+				rawKeep();
+			} else if (inited && prepare) {
+				unsigned char trk, i, field = 0;
+				unsigned short blk = 0xffff;
+				unsigned long adr = 0;
+#ifdef TRACE
+				unsigned short t0 = TCNT1;
+#endif
+
+				DISK_INT_OFF;
+				cancelRead();
+				trackChanged = 0;
+				trk = headTrk;
+#ifdef TRACE
+				if (trk != trcTrk) {
+					trcTrk = trk;
+					TRC(TRC_SEEK, trk, ph_track);
 				}
-			}
-			if (inited && prepare) {
-				cli();
-				sector = ((sector + 1) & 0xf);
-				{
-					unsigned char trk = (ph_track >> 2);
-					unsigned short long_sector = (unsigned short)trk * 16 + sector;
-					unsigned short long_cluster = (long_sector >> sectorsPerCluster2);
-					unsigned char fatNum = long_cluster / FAT_NIC_ELEMS;
-					unsigned short ft;
-
-					if (fatNum != prevFatNumNic) {
-						prevFatNumNic = fatNum;
-						prepareFat(nicDir, fatNic, ((560+sectorsPerCluster-1)>>sectorsPerCluster2), fatNum, FAT_NIC_ELEMS);
+#endif
+				if (imageType == IMG_NIC) {
+					sector = ((sector + 1) & 0xf);
+					journal();												// decode the last capture
+					for (i = 0; i < JRN_NUM; i++)
+						if ((sectors[i] == sector) && (tracks[i] == trk)) break;
+					if (i < JRN_NUM) {										// next sector is queued: write all
+						TRC(TRC_HIT, sector, trk);
+						writeBackSub();
 					}
-					ft = fatNic[long_cluster % FAT_NIC_ELEMS];
-
-					if (((sectors[0]==sector)&&(tracks[0]==trk))
-						|| ((sectors[1]==sector)&&(tracks[1]==trk))
-						|| ((sectors[2]==sector)&&(tracks[2]==trk))
-						|| ((sectors[3]==sector)&&(tracks[3]==trk))
-						|| ((sectors[4]==sector)&&(tracks[4]==trk))
-					) writeBackSub();
-
-					cmd17Fast(userAddr + (((unsigned long)(ft-2) << sectorsPerCluster2)
-						+ (long_sector & (sectorsPerCluster - 1))) * 512);
+					else if (wCount) writeBackOne();						// else one per sector
+					blk = (unsigned short)trk * 16 + sector;
+					bitLimit = 402 * 8;
+					if (trk != fieldTrk) nicFieldCheck(trk);				// a track not checked yet
+					field = fieldOnly;
+				} else if (rawStart(trk)) {									// NIB, WOZ: play from the ring
+					cli();													// PCINT0 sets both
+					prepare = (trackChanged ? 1 : 4);
+					sei();
+				}
+				if (blk != 0xffff) adr = imageAddr(blk);
+				if (field) {												// the data field and its epilogue only
+					nicAddress(headBuf, volume, trk, sector);
+					cmdFast(16, NIC_NIBBLES + 3);
+					partRead = 1;
+					adr += NIC_DATA;
+				}
+				if (blk == 0xffff) {										// 0xffff: no data under the head
+				} else if (cmd17Fast(adr)) {
 					bitbyte = 0;
-					prepare = 0;	
-				}	
-				sei();
+					if (field) {											// headBuf first, the block ends at 514 * 8
+						bitbyte = (514 - (NIC_NIBBLES + 3) - 2) * 8;
+						bitLimit = 512 * 8;
+						i = (accel ? ACCEL_SKIP : 0);
+						headPtr = headBuf + i;
+						headLeft = NIC_DATA - i;
+						headMask = 0x80;
+					} else if (accel && (imageType == IMG_NIC)) {			// skip the leading gap
+						for (i = 0; i < ACCEL_SKIP; i++) readByteFast();
+						bitbyte = ACCEL_SKIP * 8;
+					}
+					cli();													// PCINT0 sets both
+					prepare = (trackChanged ? 1 : (field ? 3 : 0));			// the head moved on meanwhile: again
+					sei();
+					sdErrors = 0;
+#ifdef TRACE
+					if (trcStream != 0xff) trcStream++;
+#endif
+				} else {													// read missed its deadline:
+					TRC(TRC_MISS, sector, trk);
+					cancelRead();											// block length back to 512
+					prepare = 2;											// sync filler, then the next sector
+					if (++sdErrors == SD_MAX_ERRORS) {						// card stuck: write back and mount again
+						writeBackSub();
+						inited = 0;
+					}
+				}
+#ifdef TRACE
+				t0 = TCNT1 - t0;
+				if (t0 > TRC_SLOW) TRC(TRC_STALL, t0 & 0xff, t0 >> 8);
+#endif
+				DISK_INT_ON;
 			}
 		}
 	}
+#endif
 }
 
 /******************************************************************************/
 void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track)
 {
 	unsigned char c,d;
+	unsigned char ox = 0;
 	unsigned short i;
-	unsigned short long_sector = (unsigned short)track*16+sc;
-	unsigned short long_cluster = (long_sector>>sectorsPerCluster2);
-	unsigned char fatNum = long_cluster/FAT_NIC_ELEMS;
-	unsigned short ft;
+	unsigned long adr;
 
-	if (bit_is_set(PIND, 3)) return;
+	if (SD_ABORT) return;
 
-	if (fatNum != prevFatNumNic) {
-		prevFatNumNic = fatNum;
-		prepareFat(nicDir, fatNic, ((560 + sectorsPerCluster - 1) >> sectorsPerCluster2), fatNum, FAT_NIC_ELEMS);
-	}
-	ft = fatNic[long_cluster % FAT_NIC_ELEMS];
+	adr = imageAddr((unsigned short)track * 16 + sc);
 	
 	PORTD = NCLKNDI_CS;
 	PORTD = NCLKNDINCS;
 
-	cmdFast(24, (unsigned long)userAddr + (((unsigned long)(ft - 2) << sectorsPerCluster2) + (unsigned long)(long_sector & (sectorsPerCluster - 1))) * 512);
+	cmdFast(24, adr);
 
 	writeByteFast(0xff);
 	writeByteFast(0xfe);
@@ -1476,9 +3376,14 @@ void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track)
 	writeByteFast(0xff);
 	writeByteFast(0xff);
 
-	// data
-	for (i = 0; i < 349; i++) {
-		c = writeData[bn][i];
+	// data, 6-and-2 encoded again from the journal
+	writeByteFast(0xd5);
+	writeByteFast(0xAA);
+	writeByteFast(0xad);
+	for (i = 0; i < NIC_NIBBLES; i++) {
+		c = nicNibble(jrnBuf(bn), i, &ox);
+		if ((i == NIC_NIBBLES - 1) && jrnBad[bn])
+			c = pgm_read_byte_near(encTable + (ox ^ 1));							// keep the checksum bad
 		for (d = 0b10000000; d; d >>= 1) {
 			if (c & d) {
 				PORTD = NCLK_DINCS;
@@ -1490,6 +3395,9 @@ void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track)
 		}
 	}
 	PORTD = NCLKNDINCS;
+	writeByteFast(0xde);
+	writeByteFast(0xAA);
+	writeByteFast(0xeb);
 	for (i = 0; i < 14 * 8; i++) {
 		PORTD = NCLK_DINCS;
 		PORTD = _CLK_DINCS;
@@ -1510,60 +3418,149 @@ void writeBackSub2(unsigned char bn, unsigned char sc, unsigned char track)
 }
 
 /******************************************************************************/
+// write the oldest journal sector
+void writeBackOne(void)
+{
+	unsigned char t = wTail;
+
+	if (SD_ABORT) return;
+	TRC(TRC_FLUSH, sectors[t], tracks[t]);
+	writeBackSub2(t, sectors[t], tracks[t]);
+	sectors[t] = 0xff;
+	tracks[t] = 0xff;
+	if (++wTail == JRN_NUM) wTail = 0;
+	wCount--;
+}
+
+/******************************************************************************/
+// compare capture slot #(c) with the data field of its sector on the
+// card, nibble for nibble: DOS and ProDOS rewrite the VTOC, catalog and
+// bitmap sectors unchanged, and reading 343 bytes back is much cheaper
+// than writing a block (no programming time, no wear)
+unsigned char sameOnCard(unsigned char c)
+{
+	unsigned char *p = capBuf(c) + 3;											// depois de D5 AA AD
+	unsigned char same = 0;
+	unsigned short i;
+	unsigned long adr;
+
+	if (SD_ABORT) return 0;
+	adr = imageAddr((unsigned short)capTrk[c] * 16 + capSec[c]) + NIC_DATA;
+	cmdFast(16, NIC_NIBBLES);
+	if (cmd17Fast(adr)) {
+		same = 1;
+		for (i = 0; i < NIC_NIBBLES; i++)
+			if (readByteFast() != p[i]) same = 0;
+		readByteFast(); readByteFast(); // discard CRC bytes
+	}
+	cmdFast(16, (unsigned long)512);
+	return same;
+}
+
+/******************************************************************************/
+// decode capture slot #(c) into the journal, writing the oldest journal
+// sector first if the journal is full; a capture the card already holds
+// is dropped, unless the journal has another version of that sector
+void journalOne(unsigned char c)
+{
+	unsigned char j;
+
+	for (j = 0; j < JRN_NUM; j++)
+		if ((sectors[j] == capSec[c]) && (tracks[j] == capTrk[c])) break;
+	if ((j == JRN_NUM) && sameOnCard(c)) {
+		TRC(TRC_SAME, capSec[c], capTrk[c]);
+		capSec[c] = capTrk[c] = 0xff;
+		capBuf(c)[2] = 0;
+		return;
+	}
+	if (wCount == JRN_NUM) writeBackOne();
+	if (wCount == JRN_NUM) return;												// Carto removido
+	j = wTail + wCount;
+	if (j >= JRN_NUM) j -= JRN_NUM;
+	TRC(TRC_WRITE, capSec[c], capTrk[c]);
+	jrnBad[j] = !nicDecode(jrnBuf(j), capBuf(c) + 3);							// depois de D5 AA AD
+	sectors[j] = capSec[c];
+	tracks[j] = capTrk[c];
+	wCount++;
+	capSec[c] = capTrk[c] = 0xff;
+	capBuf(c)[2] = 0;
+}
+
+/******************************************************************************/
+// decode the capture slots INT0 is done with, oldest first; if it held
+// the next capture back (all slots full), it goes on into the one freed
+void journal(void)
+{
+	unsigned char c = buffNum;
+
+	do {
+		if (++c == CAP_NUM) c = 0;
+		if (capSec[c] != 0xff) journalOne(c);
+	} while (c != buffNum);
+	if (++c == CAP_NUM) c = 0;
+	if (!writePtr && (capSec[c] == 0xff)) {
+		buffNum = c;
+		writePtr = capBuf(c);
+	}
+}
+
+/******************************************************************************/
+// capture slots holding a data field not journaled yet
+unsigned char capQueued(void)
+{
+	unsigned char i, n = 0;
+
+	for (i = 0; i < CAP_NUM; i++)
+		if (capSec[i] != 0xff) n++;
+	return n;
+}
+
+/******************************************************************************/
+// write every captured and journaled sector
 void writeBackSub(void)
 {
-	unsigned char i, j;
-
-	if (bit_is_set(PIND, 3)) return;
-	for (j = 0; j < BUF_NUM; j++) {
-		if (sectors[j] != 0xff) {
-			for (i = 0; i < BUF_NUM; i++) {
-				if (sectors[i] != 0xff)
-					writeBackSub2(i, sectors[i], tracks[i]);
-				sectors[i] = 0xff;
-				tracks[i] = 0xff;
-				writeData[i][2]=0;
-			}
-			buffNum = 0;
-			writePtr = &(writeData[buffNum][0]);
-			break;
-		}
+	journal();
+	while (wCount) {
+		if (SD_ABORT) return;
+		writeBackOne();
 	}
 }
 
 /******************************************************************************/
-// write back writeData into the SD card
+// called from INT0 after a field was captured: hand a data field to the
+// main loop and capture into the next slot; if that one was not decoded
+// yet, the main loop is behind: no card I/O here, the next capture is
+// held back (writePtr 0, INT0 ignores WRITE) and the stream stops, so
+// that the Apple finds no sector to write until journal() frees a slot
 void writeBack(void)
 {
 	static unsigned char sec;
+	unsigned char n;
 	
-	if (bit_is_set(PIND, 3)) return;
-	if (writeData[buffNum][2] == 0xAD) {
+	if (SD_ABORT) return;
+	if (imageType != IMG_NIC) return;												// raw tracks are read only
+	if (capBuf(buffNum)[2] == 0xAD) {
 		if (!formatting) {
-			sectors[buffNum] = sector;
-			tracks[buffNum] = (ph_track >> 2);
+			capSec[buffNum] = sector;
+			capTrk[buffNum] = headTrk;
 			sector = ((((sector == 0xf) || (sector == 0xd)) ? (sector + 2) : (sector + 1)) & 0xf);
-			if (buffNum == (BUF_NUM - 1)) {
-				// cancel reading
-				cancelRead();
-				writeBackSub();
+			n = buffNum + 1;
+			if (n == CAP_NUM) n = 0;
+			if (capSec[n] == 0xff) {
+				buffNum = n;
+				writePtr = capBuf(n);
+			} else {														// main loop is behind
+				writePtr = 0;
 				prepare = 1;
-			} else {
-				buffNum++;
-				writePtr = &(writeData[buffNum][0]);
 			}
 		} else {
 			sector = sec;
 			formatting = 0;
-			if (sec == 0xf) {
-				// cancel reading
-				cancelRead();
-				prepare = 1;
-			}
+			if (sec == 0xf) prepare = 1;											// the main loop cancels reading
 		}
 	}
-	if (writeData[buffNum][2] == 0x96) {
-		sec = (((writeData[buffNum][7] & 0x55) << 1) | (writeData[buffNum][8] & 0x55));
+	if (writePtr && (capBuf(buffNum)[2] == 0x96)) {
+		sec = (((capBuf(buffNum)[7] & 0x55) << 1) | (capBuf(buffNum)[8] & 0x55));
 		formatting = 1;
 	}
 }
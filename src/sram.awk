@@ -0,0 +1,47 @@
+# sram.awk - static SRAM use of the firmware from the linker map
+# (make sram): the global symbols by size, then .data, .bss and
+# COMMON per object file, and what is left for the stack
+
+function hex(s,   i, n) {
+	n = 0
+	s = tolower(s)
+	sub(/^0x/, "", s)
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return n
+}
+
+{ sub(/\r$/, "") }
+
+# "Common symbol  size  file", a long name is alone on its line
+/^Allocating common symbols/ { common = 1; next }
+/^Discarded input sections/ || /^Memory Configuration/ { common = 0 }
+common && /^Common symbol/ { next }
+common && NF == 1 { name = $1; next }
+common && NF >= 3 && $2 ~ /^0x/ { sym[$1] = hex($2); next }
+common && NF >= 2 && $1 ~ /^0x/ && name != "" { sym[name] = hex($1); name = ""; next }
+
+# input sections placed in SRAM (0x800100 and up)
+$1 ~ /^(\.data|\.bss|\.noinit|COMMON)/ && NF >= 4 && $2 ~ /^0x0*80/ && $4 != "load" {
+	f = $4
+	for (i = 5; i <= NF; i++) f = f " " $i
+	sub(/.*[\/\\]/, "", f)
+	sec = $1
+	sub(/\..*\./, ".", sec)
+	n = hex($3)
+	if (n) {
+		obj[f " " sec] += n
+		total += n
+	}
+}
+
+END {
+	print "globals (common symbols), bytes:"
+	cmd = "sort -k2 -n -r"
+	for (s in sym) printf("  %-24s %5d\n", s, sym[s]) | cmd
+	close(cmd)
+	print "sections per object file, bytes:"
+	for (s in obj) printf("  %-32s %5d\n", s, obj[s]) | cmd
+	close(cmd)
+	printf("static SRAM %d of %d bytes, %d left for the stack\n", total, ram, ram - total)
+}
@@ -0,0 +1,51 @@
+/*------------------------------------
+
+	SDISK II LCD Firmware
+
+	SD access trace (TRACE build), shared by the firmware (sdisk2.c)
+	and the host analyzer (../tools/trcstat.c)
+
+------------------------------------*/
+
+/*
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// the trace is written to SDISK2.TRC in the root directory, from its
+// start at every mount; a type 0 record ends it
+#define TRC_NAME		"SDISK2  "
+#define TRC_EXT			"TRC"
+#define TRC_SECTORS		256		// created with 128KB, 32768 records
+
+// a record is 4 bytes: type, a, b, and the number of sectors streamed
+// since the previous record (255 at most)
+#define TRC_REC			4
+
+#define TRC_MOUNT		1		// a: image type | 0x80 contiguous | 0x40 accel, b: sectorsPerCluster2
+#define TRC_SEEK		2		// a: track, b: quarter track
+#define TRC_WRITE		3		// a, b: sector, track of a captured data field
+#define TRC_HIT			4		// a, b: sector, track to stream while in the journal
+#define TRC_FLUSH		5		// a, b: sector, track written back to the image
+#define TRC_FAT			6		// a: cluster map window walked by prepareFat
+#define TRC_STALL		7		// a, b: low, high of a slow prepare in ticks
+#define TRC_MISS		8		// a, b: sector, track whose read missed its deadline
+#define TRC_IDLE		9		// a: journal sectors queued when the drive was disabled
+#define TRC_LOST		10		// a: records lost while the ring was full
+#define TRC_SAME		11		// a, b: sector, track of a capture dropped, the card had it already
+
+// Timer1 runs at F_CPU / 64 (2.56 us at 25MHz), a prepare longer than
+// TRC_SLOW ticks (1 ms) is recorded as a stall
+#define TRC_TICK_NS		2560
+#define TRC_SLOW		390
+
+#endif
@@ -0,0 +1,309 @@
+/*------------------------------------
+
+	dsk2nic - batch DSK/PO to NIC converter for SDISK II
+
+	Uses the firmware's own encoder (../src/nic.c), so the NIC files
+	are byte-identical to the ones dsk2Nic() writes on the card.
+
+------------------------------------*/
+
+/*
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "nic.h"
+
+// the firmware always writes volume 254
+#define VOLUME 0xfe
+
+static char **files;
+static int fileNum, fileMax;
+static int nextFile;
+static int done, failed, mismatched;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *outDir;
+static int checkMode, force, verbose;
+
+/******************************************************************************/
+// extension of a file name, "" if none
+static const char *extOf(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	const char *dot = strrchr(base ? base : name, '.');
+
+	return dot ? dot + 1 : "";
+}
+
+/******************************************************************************/
+// image file order: 'D' for DOS 3.3 (.DSK, .DO), 'P' for ProDOS (.PO), 0 otherwise
+static int imageOrder(const char *name)
+{
+	const char *ext = extOf(name);
+
+	if (!strcasecmp(ext, "dsk") || !strcasecmp(ext, "do")) return 'D';
+	if (!strcasecmp(ext, "po")) return 'P';
+	return 0;
+}
+
+/******************************************************************************/
+// add a file to the work list
+static void addFile(const char *path)
+{
+	if (fileNum == fileMax) {
+		fileMax = fileMax ? fileMax * 2 : 256;
+		files = realloc(files, fileMax * sizeof(char *));
+		if (!files) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	files[fileNum++] = strdup(path);
+}
+
+/******************************************************************************/
+// add a file, or every image below a directory
+static void addPath(const char *path)
+{
+	struct stat st;
+	DIR *d;
+	struct dirent *e;
+	char *sub;
+
+	if (stat(path, &st) != 0) {
+		perror(path);
+		failed++;
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		addFile(path);
+		return;
+	}
+	if (!(d = opendir(path))) {
+		perror(path);
+		failed++;
+		return;
+	}
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+		sub = malloc(strlen(path) + strlen(e->d_name) + 2);
+		sprintf(sub, "%s/%s", path, e->d_name);
+		if ((stat(sub, &st) == 0) && (S_ISDIR(st.st_mode) || imageOrder(sub)))
+			addPath(sub);
+		free(sub);
+	}
+	closedir(d);
+}
+
+/******************************************************************************/
+// name of the NIC file for an image: same base name, NIC (or nic) extension,
+// in outDir if one is given
+static char *nicName(const char *path)
+{
+	const char *ext = extOf(path);
+	const char *base = strrchr(path, '/');
+	char *name;
+	size_t n;
+
+	base = base ? base + 1 : path;
+	n = (outDir ? strlen(outDir) + 1 + strlen(base) : strlen(path)) + 5;
+	name = malloc(n);
+	if (outDir)
+		sprintf(name, "%s/%s", outDir, base);
+	else
+		strcpy(name, path);
+	if (*ext) name[strlen(name) - strlen(ext) - 1] = '\0';
+	strcat(name, (*ext >= 'a') ? ".nic" : ".NIC");
+	return name;
+}
+
+/******************************************************************************/
+// read a whole file of (len) bytes, return 0 if its size differs
+static int readFile(const char *path, unsigned char *buf, unsigned long len)
+{
+	FILE *fp = fopen(path, "rb");
+	int ok;
+
+	if (!fp) return 0;
+	ok = (fread(buf, 1, len, fp) == len) && (fgetc(fp) == EOF);
+	fclose(fp);
+	return ok;
+}
+
+/******************************************************************************/
+// the firmware's write journal: every data field of (nic) must decode
+// (nicDecode) to its sector of (src) and encode again (nicNibble) to the
+// same nibbles; return the first failing sector, -1 if none
+static int journalCheck(const unsigned char *nic, const unsigned char *src, int order)
+{
+	unsigned char ox;
+	unsigned char cap[NIC_NIBBLES], data[256];
+	const unsigned char *d;
+	unsigned short n, k, i;
+
+	for (n = 0; n < NIC_TRACKS * NIC_SECTORS; n++) {
+		k = nicPlace(n, order);
+		d = nic + (unsigned long)k * NIC_SECT_SIZE + NIC_DATA;
+		memcpy(cap, d, NIC_NIBBLES);
+		if (!nicDecode(data, cap) || memcmp(data, src + (unsigned long)n * 256, 256))
+			return k;
+		for (i = 0, ox = 0; i < NIC_NIBBLES; i++)
+			if (nicNibble(data, i, &ox) != d[i])
+				return k;
+	}
+	return -1;
+}
+
+/******************************************************************************/
+// convert (or check) one image, return 0 on success
+static int doFile(const char *path, unsigned char *src, unsigned char *dst, unsigned char *ref)
+{
+	int order = imageOrder(path);
+	char *out;
+	FILE *fp;
+	unsigned long i;
+	int ret = 0;
+
+	if (!order) {
+		fprintf(stderr, "%s: not a DSK, DO or PO image\n", path);
+		return 1;
+	}
+	if (!readFile(path, src, DSK_SIZE)) {
+		fprintf(stderr, "%s: not a %lu byte image\n", path, DSK_SIZE);
+		return 1;
+	}
+	nicImage(dst, src, VOLUME, order);
+	out = nicName(path);
+	if (checkMode) {
+		// decode and encode again as the write journal does
+		i = journalCheck(dst, src, order);
+		if (i != (unsigned long)-1) {
+			fprintf(stderr, "%s: journal round trip differs (track %lu, sector %lu)\n",
+				path, i / NIC_SECTORS, i % NIC_SECTORS);
+			ret = 2;
+		}
+		// compare with the NIC file the firmware wrote on the card
+		else if (!readFile(out, ref, NIC_SIZE)) {
+			fprintf(stderr, "%s: no %lu byte reference\n", out, NIC_SIZE);
+			ret = 1;
+		} else {
+			for (i = 0; (i < NIC_SIZE) && (dst[i] == ref[i]); i++) ;
+			if (i < NIC_SIZE) {
+				fprintf(stderr, "%s: differs at 0x%05lx (track %lu, sector %lu, byte 0x%03lx)\n",
+					out, i, i / (NIC_SECTORS * NIC_SECT_SIZE),
+					(i / NIC_SECT_SIZE) % NIC_SECTORS, i % NIC_SECT_SIZE);
+				ret = 2;
+			} else if (verbose)
+				printf("%s: ok\n", out);
+		}
+	} else if (!force && (access(out, F_OK) == 0)) {
+		fprintf(stderr, "%s: exists, use -f to overwrite\n", out);
+		ret = 1;
+	} else if (!(fp = fopen(out, "wb")) ||
+			(fwrite(dst, 1, NIC_SIZE, fp) != NIC_SIZE) | (fclose(fp) != 0)) {
+		perror(out);
+		ret = 1;
+	} else if (verbose)
+		printf("%s -> %s\n", path, out);
+	free(out);
+	return ret;
+}
+
+/******************************************************************************/
+// worker thread: take the next file until the list is done
+static void *worker(void *arg)
+{
+	unsigned char *src = malloc(DSK_SIZE);
+	unsigned char *dst = malloc(NIC_SIZE);
+	unsigned char *ref = malloc(NIC_SIZE);
+	int n, r;
+
+	(void)arg;
+	if (!src || !dst || !ref) {
+		perror("malloc");
+		exit(2);
+	}
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		n = nextFile++;
+		pthread_mutex_unlock(&lock);
+		if (n >= fileNum) break;
+		r = doFile(files[n], src, dst, ref);
+		pthread_mutex_lock(&lock);
+		if (r == 0) done++; else if (r == 2) mismatched++; else failed++;
+		pthread_mutex_unlock(&lock);
+	}
+	free(src);
+	free(dst);
+	free(ref);
+	return NULL;
+}
+
+/******************************************************************************/
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: dsk2nic [-c] [-f] [-v] [-j jobs] [-o dir] image|directory ...\n"
+		"  converts DSK/DO (DOS 3.3 order) and PO (ProDOS order) images\n"
+		"  into NIC images as the SDISK II firmware does\n"
+		"  -c       check: compare with existing NIC files (e.g. written by\n"
+		"           the firmware on the card) instead of writing them, and\n"
+		"           check that the write journal decodes and encodes every\n"
+		"           data field back to the same bytes\n"
+		"  -f       overwrite existing NIC files\n"
+		"  -v       report every file\n"
+		"  -j jobs  number of threads (default: number of CPUs)\n"
+		"  -o dir   write (or look for) NIC files in dir\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *th;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int c, i;
+
+	while ((c = getopt(argc, argv, "cfvj:o:")) != -1) {
+		switch (c) {
+		case 'c': checkMode = 1; break;
+		case 'f': force = 1; break;
+		case 'v': verbose = 1; break;
+		case 'j': jobs = atol(optarg); break;
+		case 'o': outDir = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind >= argc) usage();
+	for (i = optind; i < argc; i++) addPath(argv[i]);
+	if (jobs < 1) jobs = 1;
+	if (jobs > fileNum) jobs = fileNum ? fileNum : 1;
+
+	th = malloc(jobs * sizeof(pthread_t));
+	for (i = 0; i < jobs; i++)
+		if (pthread_create(&th[i], NULL, worker, NULL) != 0) {
+			perror("pthread_create");
+			exit(2);
+		}
+	for (i = 0; i < jobs; i++) pthread_join(th[i], NULL);
+
+	if (checkMode)
+		printf("%d identical, %d differ, %d failed\n", done, mismatched, failed);
+	else if (verbose || failed)
+		printf("%d converted, %d failed\n", done, failed);
+	return (failed || mismatched) ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+/*------------------------------------
+
+	mksdc - SDC disk container builder for SDISK II
+
+	Packs NIC, NIB and WOZ images into one SDC file (../src/sdc.h);
+	DSK, DO and PO images are converted to NIC with the firmware's
+	own encoder (../src/nic.c). The firmware mounts a disk of it and
+	browses it from the index alone, so the SDC file must be
+	contiguous on the card: copy it to a fresh card, or run sdopt.
+
+------------------------------------*/
+
+/*
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "nic.h"
+#include "sdc.h"
+
+// the firmware's image types (IMG_ in sdisk2.c)
+#define IMG_NIC		0
+#define IMG_NIB		1
+#define IMG_WOZ		2
+
+// a NIB image is 35 tracks of 6656 nibbles
+#define NIB_SIZE	(35UL * 6656)
+
+// the firmware always writes volume 254
+#define VOLUME 0xfe
+
+static int readOnly, verbose;
+
+/******************************************************************************/
+// extension of a file name, "" if none
+static const char *extOf(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	const char *dot = strrchr(base ? base : name, '.');
+
+	return dot ? dot + 1 : "";
+}
+
+/******************************************************************************/
+// the 8 character disk name of an image: its base name in upper case,
+// space padded, as in a directory entry
+static void diskName(char *dst, const char *path)
+{
+	const char *base = strrchr(path, '/');
+	int i;
+
+	base = base ? base + 1 : path;
+	memset(dst, ' ', 8);
+	for (i = 0; (i < 8) && base[i] && (base[i] != '.'); i++)
+		dst[i] = isalnum((unsigned char)base[i]) ? toupper((unsigned char)base[i]) : '_';
+}
+
+/******************************************************************************/
+// read a whole file, *len is its size
+static unsigned char *readAll(const char *path, unsigned long *len)
+{
+	FILE *fp = fopen(path, "rb");
+	unsigned char *buf;
+	long n;
+
+	if (!fp) return NULL;
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = malloc(n ? n : 1);
+	if (!buf || (fread(buf, 1, n, fp) != (size_t)n)) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	*len = n;
+	return buf;
+}
+
+/******************************************************************************/
+// load an image as the firmware plays it: *type is its IMG_ type,
+// *len its size; NULL if it is not one
+static unsigned char *loadImage(const char *path, int *type, unsigned long *len)
+{
+	const char *ext = extOf(path);
+	unsigned char *buf, *nic;
+
+	if (!(buf = readAll(path, len))) {
+		perror(path);
+		return NULL;
+	}
+	if (!strcasecmp(ext, "nic") && (*len == NIC_SIZE)) {
+		*type = IMG_NIC;
+		return buf;
+	}
+	if (!strcasecmp(ext, "nib") && (*len == NIB_SIZE)) {
+		*type = IMG_NIB;
+		return buf;
+	}
+	if (!strcasecmp(ext, "woz") && (*len > 12) && !memcmp(buf, "WOZ2", 4)) {
+		*type = IMG_WOZ;
+		return buf;
+	}
+	if ((!strcasecmp(ext, "dsk") || !strcasecmp(ext, "do") || !strcasecmp(ext, "po")) &&
+		(*len == DSK_SIZE)) {
+		if (!(nic = malloc(NIC_SIZE))) {
+			perror("malloc");
+			exit(2);
+		}
+		nicImage(nic, buf, VOLUME, (tolower((unsigned char)ext[0]) == 'p') ? 'P' : 'D');
+		free(buf);
+		*type = IMG_NIC;
+		*len = NIC_SIZE;
+		return nic;
+	}
+	fprintf(stderr, "%s: not a NIC, NIB, WOZ2, DSK, DO or PO image\n", path);
+	free(buf);
+	return NULL;
+}
+
+/******************************************************************************/
+// little endian fields of an index record
+static void put16(unsigned char *p, unsigned long v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static unsigned long get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const unsigned char *p)
+{
+	return get16(p) | (get16(p + 2) << 16);
+}
+
+/******************************************************************************/
+// print the index of a container
+static int list(const char *path)
+{
+	static const char *typeName[] = { "NIC", "NIB", "WOZ" };
+	FILE *fp = fopen(path, "rb");
+	unsigned char r[SDC_REC];
+	unsigned long num, i;
+
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+	if ((fread(r, 1, SDC_REC, fp) != SDC_REC) || memcmp(r, SDC_MAGIC, 4)) {
+		fprintf(stderr, "%s: not an SDC container\n", path);
+		fclose(fp);
+		return 1;
+	}
+	num = get16(r + SDC_COUNT);
+	printf("%s: %lu disks\n", path, num);
+	for (i = 1; (i <= num) && (fread(r, 1, SDC_REC, fp) == SDC_REC); i++)
+		printf("%5lu  %.8s  %s%s  %5lu blocks at %lu\n", i, r + SDC_NAME,
+			(r[SDC_TYPE] <= IMG_WOZ) ? typeName[r[SDC_TYPE]] : "?",
+			(r[SDC_FLAGS] & SDC_READONLY) ? " ro" : "   ",
+			get16(r + SDC_BLOCKS), get32(r + SDC_FIRST));
+	fclose(fp);
+	return 0;
+}
+
+/******************************************************************************/
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: mksdc [-r] [-v] OUT.SDC image ...\n"
+		"       mksdc -l OUT.SDC\n"
+		"  packs NIC, NIB, WOZ (WOZ2), DSK/DO and PO images into an SDC\n"
+		"  container; DSK/DO/PO images are converted to NIC as the firmware\n"
+		"  does, disks are named after the first 8 characters of the files\n"
+		"  -r       mount every disk write protected\n"
+		"  -v       report every disk\n"
+		"  -l       list the disks of a container\n"
+		"  the container must be contiguous on the card (a fresh card, or sdopt)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *out;
+	unsigned char *index, *img, pad[512];
+	unsigned long num, idxBlocks, first, len, blocks;
+	int c, type, failed = 0, listMode = 0;
+	FILE *fp;
+
+	while ((c = getopt(argc, argv, "rvl")) != -1) {
+		switch (c) {
+		case 'r': readOnly = 1; break;
+		case 'v': verbose = 1; break;
+		case 'l': listMode = 1; break;
+		default: usage();
+		}
+	}
+	if (listMode) {
+		if (optind + 1 != argc) usage();
+		return list(argv[optind]);
+	}
+	if (optind + 2 > argc) usage();
+	out = argv[optind++];
+	num = argc - optind;
+	if (num > SDC_MAX) {
+		fprintf(stderr, "at most %d disks\n", SDC_MAX);
+		return 2;
+	}
+
+	// the index, rewritten once the images are in
+	idxBlocks = ((num + 1) * SDC_REC + 511) / 512;
+	index = calloc(idxBlocks, 512);
+	if (!index) {
+		perror("calloc");
+		return 2;
+	}
+	if (!(fp = fopen(out, "wb"))) {
+		perror(out);
+		return 2;
+	}
+	if (fwrite(index, 512, idxBlocks, fp) != idxBlocks) goto wrfail;
+	memset(pad, 0, sizeof(pad));
+
+	first = idxBlocks;
+	num = 0;
+	for (; optind < argc; optind++) {
+		unsigned char *r;
+
+		if (!(img = loadImage(argv[optind], &type, &len))) {
+			failed++;
+			continue;
+		}
+		blocks = (len + 511) / 512;
+		if (blocks > 0xffff) {
+			fprintf(stderr, "%s: too large\n", argv[optind]);
+			free(img);
+			failed++;
+			continue;
+		}
+		if ((fwrite(img, 1, len, fp) != len) ||
+			(fwrite(pad, 1, blocks * 512 - len, fp) != blocks * 512 - len)) {
+			free(img);
+			goto wrfail;
+		}
+		free(img);
+		r = index + (++num) * SDC_REC;
+		diskName((char *)r + SDC_NAME, argv[optind]);
+		r[SDC_TYPE] = type;
+		r[SDC_FLAGS] = readOnly ? SDC_READONLY : 0;
+		put16(r + SDC_BLOCKS, blocks);
+		put32(r + SDC_FIRST, first);
+		if (verbose)
+			printf("%5lu  %.8s  %s -> block %lu\n", num, r + SDC_NAME, argv[optind], first);
+		first += blocks;
+	}
+	memcpy(index, SDC_MAGIC, 4);
+	put16(index + SDC_COUNT, num);
+	if (fseek(fp, 0, SEEK_SET) || (fwrite(index, 512, idxBlocks, fp) != idxBlocks) || fclose(fp))
+		goto wrfail0;
+	free(index);
+	if (verbose || failed)
+		printf("%s: %lu disks, %lu blocks, %d failed\n", out, num, first, failed);
+	return failed ? 1 : 0;
+
+wrfail:
+	fclose(fp);
+wrfail0:
+	perror(out);
+	return 2;
+}
@@ -0,0 +1,438 @@
+/*------------------------------------
+
+	sdopt - FAT16 card layout optimizer for SDISK II
+
+	Rewrites a FAT16 card (an image file or the card's block device)
+	into the layout the firmware reads fastest:
+
+	- root directory compacted (deleted and LFN entries dropped),
+	  the BTF entry first, then the rest sorted by name
+	- every root file contiguous, in directory order, so imageAddr()
+	  never walks the FAT (subdirectories and their files stay put)
+
+	and prints an estimate of the SD commands the firmware issues
+	before and after.
+
+------------------------------------*/
+
+/*
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+*/
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// the firmware's cluster window (FAT_NIC_ELEMS in sdisk2.c)
+#define FAT_NIC_ELEMS 35
+// the firmware always scans 512 root entries
+#define FW_ROOT_ENTRIES 512
+
+#define ATTR_LFN	0x0f
+#define ATTR_VOLUME	0x08
+#define ATTR_DIR	0x10
+
+typedef struct {
+	unsigned char e[32];
+	unsigned char *data;			// contents of a moved file
+	unsigned long clusters;		// its cluster count
+} entry_t;
+
+static int fd;
+static unsigned long long bpbAddr, fatAddr, rootAddr, userAddr;
+static unsigned int spc, fatSz, nFats, rootEnts;
+static unsigned long clusterNum;	// data clusters + 2
+static unsigned short *fat;
+static unsigned char *pinned;		// clusters of subdirectories and their files
+static entry_t *ents;
+static int entNum;
+
+/******************************************************************************/
+static unsigned short le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static void rd(unsigned long long adr, void *buf, size_t len)
+{
+	if (pread(fd, buf, len, adr) != (ssize_t)len) {
+		perror("read");
+		exit(2);
+	}
+}
+
+static void wr(unsigned long long adr, const void *buf, size_t len)
+{
+	if (pwrite(fd, buf, len, adr) != (ssize_t)len) {
+		perror("write");
+		exit(2);
+	}
+}
+
+static unsigned long long clusterAddr(unsigned long c)
+{
+	return userAddr + (unsigned long long)(c - 2) * spc * 512;
+}
+
+/******************************************************************************/
+// locate the volume as mountImage() does and read the BPB
+static void readVolume(void)
+{
+	unsigned char b[512];
+	unsigned long totSec, dataSec;
+
+	rd(0, b, 512);
+	if (memcmp(b + 54, "FAT16", 5) == 0)
+		bpbAddr = 0;
+	else
+		bpbAddr = (unsigned long long)le32(b + 0x1c6) * 512;
+	rd(bpbAddr, b, 512);
+	if (le16(b + 11) != 512) {
+		fprintf(stderr, "not a FAT16 volume with 512-byte sectors\n");
+		exit(2);
+	}
+	spc = b[13];
+	nFats = b[16];
+	rootEnts = le16(b + 17);
+	totSec = le16(b + 19) ? le16(b + 19) : le32(b + 32);
+	fatSz = le16(b + 22);
+	fatAddr = bpbAddr + (unsigned long long)le16(b + 14) * 512;
+	rootAddr = fatAddr + (unsigned long long)fatSz * nFats * 512;
+	userAddr = rootAddr + (unsigned long long)rootEnts * 32;
+	dataSec = totSec - le16(b + 14) - fatSz * nFats - rootEnts * 32 / 512;
+	clusterNum = dataSec / spc + 2;
+	if (!spc || (spc & (spc - 1)) || (nFats != 2) || (rootEnts != FW_ROOT_ENTRIES) ||
+		(clusterNum < 4087) || (clusterNum > 65526) || (clusterNum > (unsigned long)fatSz * 256)) {
+		fprintf(stderr, "not a FAT16 volume the firmware can read\n"
+			"(two FATs, %d root entries, power-of-two cluster size)\n", FW_ROOT_ENTRIES);
+		exit(2);
+	}
+	fat = malloc((size_t)fatSz * 512);
+	pinned = calloc(clusterNum, 1);
+	rd(fatAddr, fat, (size_t)fatSz * 512);
+}
+
+/******************************************************************************/
+// follow a cluster chain, marking it pinned if asked; return its length
+static unsigned long chainLen(unsigned long c, int pin)
+{
+	unsigned long n = 0;
+
+	while ((c >= 2) && (c < clusterNum) && (n < clusterNum)) {
+		if (pin) pinned[c] = 1;
+		n++;
+		c = fat[c];
+	}
+	return n;
+}
+
+/******************************************************************************/
+// pin a subdirectory and everything below it
+static void pinDir(unsigned long c)
+{
+	unsigned long n = chainLen(c, 0), i, j;
+	unsigned char *buf;
+
+	if (!n || pinned[c]) return;
+	chainLen(c, 1);
+	buf = malloc((size_t)spc * 512);
+	for (i = 0; i < n; i++, c = fat[c]) {
+		rd(clusterAddr(c), buf, (size_t)spc * 512);
+		for (j = 0; j < (unsigned long)spc * 512; j += 32) {
+			unsigned char *e = buf + j;
+			if (e[0] == 0x00) break;
+			if ((e[0] == 0xe5) || (e[0] == '.') || (e[11] == ATTR_LFN)) continue;
+			if (e[11] & ATTR_DIR) pinDir(le16(e + 26));
+			else chainLen(le16(e + 26), 1);
+		}
+	}
+	free(buf);
+}
+
+/******************************************************************************/
+// read the live root entries, dropping deleted and LFN ones
+static void readRoot(unsigned char *root)
+{
+	unsigned int i;
+
+	rd(rootAddr, root, rootEnts * 32);
+	ents = calloc(rootEnts, sizeof(entry_t));
+	for (i = 0; i < rootEnts; i++) {
+		unsigned char *e = root + i * 32;
+		if (e[0] == 0x00) break;
+		if ((e[0] == 0xe5) || (e[11] == ATTR_LFN)) continue;
+		memcpy(ents[entNum++].e, e, 32);
+		if ((e[11] & ATTR_DIR) && !(e[11] & ATTR_VOLUME)) pinDir(le16(e + 26));
+	}
+}
+
+/******************************************************************************/
+// SD command estimate, following the firmware's access pattern
+
+// findExt() / makeFileNameList() cost of one root entry
+static unsigned long scanCost(const unsigned char *e, int list)
+{
+	unsigned char d = e[0];
+
+	if ((d == 0x00) || (d == 0x05) || (d == 0x2e) || (d == 0xe5) ||
+		!(((d >= 'A') && (d <= 'Z')) || ((d >= '0') && (d <= '9'))))
+		return 2;															// CMD16 + CMD17
+	if ((e[11] & 0x1e) || (e[11] == ATTR_LFN))
+		return 3;															// + CMD17 (attribute)
+	return list ? 5 : 7;													// + name (+ time stamp)
+}
+
+// root entry the firmware's findExt() returns, -1 if none
+static int findExt(const unsigned char *root, const char *ext, const unsigned char *name)
+{
+	unsigned int i, tm, dt, maxTm = 0, maxDt = 0;
+	int found = -1;
+
+	for (i = 0; i < FW_ROOT_ENTRIES; i++) {
+		const unsigned char *e = root + i * 32;
+		if (scanCost(e, 0) != 7) continue;
+		if (memcmp(e + 8, ext, 3) || (name && memcmp(e, name, 8))) continue;
+		tm = le16(e + 22);
+		dt = le16(e + 24);
+		if ((dt > maxDt) || ((dt == maxDt) && (tm >= maxTm))) {
+			maxTm = tm;
+			maxDt = dt;
+			found = i;
+		}
+	}
+	return found;
+}
+
+typedef struct {
+	unsigned long mount;			// mountImage() + saveMount()
+	unsigned long list;				// the chooser's file list and sort
+	unsigned long seek;				// prepareFat() while reading the image once
+	unsigned long fragmented;		// root files that are not contiguous
+	unsigned long entries;			// root entries in use, LFN and deleted included
+} cost_t;
+
+static void estimate(const unsigned char *root, const unsigned short *ft, cost_t *c)
+{
+	static const char *exts[] = { "NIC", "NIB", "WOZ" };
+	unsigned long scan = 0, list = 0, n, i, k, cl, len, win;
+	const unsigned char *name = NULL;
+	int btf, img = -1;
+
+	memset(c, 0, sizeof(*c));
+	for (i = 0; i < FW_ROOT_ENTRIES; i++) {
+		const unsigned char *e = root + i * 32;
+		scan += scanCost(e, 0);
+		list += scanCost(e, 1);
+		if (e[0]) c->entries++;
+		if ((scanCost(e, 0) == 7) && (le16(e + 26) >= 2) && (le16(e + 26) < clusterNum)) {
+			cl = le16(e + 26);
+			len = (le32(e + 28) + (unsigned long)spc * 512 - 1) / (spc * 512);
+			for (k = 1; (k < len) && (cl < clusterNum) && (ft[cl] == cl + 1); k++, cl++) ;
+			if (k < len) c->fragmented++;
+		}
+	}
+
+	// BPB: four CMD16 + CMD17 pairs
+	c->mount = 8;
+	btf = findExt(root, "BTF", NULL);
+	c->mount += scan;
+	if (btf >= 0) {
+		name = root + btf * 32;
+		c->mount += 2;
+	}
+	for (i = 0; (i < 3) && (img < 0); i++) {
+		img = findExt(root, exts[i], name);
+		c->mount += scan;
+	}
+	if (img < 0) return;
+
+	// openImage(): size, then the FAT sectors of the contiguity check
+	cl = le16(root + img * 32 + 26);
+	if ((cl < 2) || (cl >= clusterNum)) return;
+	len = (le32(root + img * 32 + 28) + (unsigned long)spc * 512 - 1) / (spc * 512);
+	c->mount += 2 + 2;
+	for (k = 1; (k < len) && (cl < clusterNum) && (ft[cl] == cl + 1); k++, cl++)
+		if (((cl + 1) & 0xff) == 0) c->mount += 2;
+	if (k < len) {
+		// fragmented: every cluster window costs a prepareFat() walk
+		for (win = 0; win * FAT_NIC_ELEMS < len; win++)
+			c->seek += 3 + ((len < (win + 1) * FAT_NIC_ELEMS) ? len : (win + 1) * FAT_NIC_ELEMS);
+		c->mount += 3 + ((len < FAT_NIC_ELEMS) ? len : FAT_NIC_ELEMS);	// saveMount()
+	}
+	c->mount += 2 + 1;														// saveMount()
+
+	// the chooser: list, then the bubble sort reads two names per compare
+	for (n = 0, i = 0; i < FW_ROOT_ENTRIES; i++) {
+		const unsigned char *e = root + i * 32;
+		if ((scanCost(e, 1) == 5) && (!memcmp(e + 8, "NIC", 3) ||
+			!memcmp(e + 8, "NIB", 3) || !memcmp(e + 8, "WOZ", 3))) n++;
+	}
+	c->list = list + (n > 1 ? n * (n - 1) / 2 * 4 : 0);
+}
+
+/******************************************************************************/
+// BTF entries first, the volume label next, then by name and extension
+static int cmpEnt(const void *a, const void *b)
+{
+	const unsigned char *x = ((const entry_t *)a)->e, *y = ((const entry_t *)b)->e;
+	int bx = !memcmp(x + 8, "BTF", 3) && !(x[11] & (ATTR_DIR | ATTR_VOLUME));
+	int by = !memcmp(y + 8, "BTF", 3) && !(y[11] & (ATTR_DIR | ATTR_VOLUME));
+	int vx = (x[11] & ATTR_VOLUME) && !(x[11] & ATTR_DIR);
+	int vy = (y[11] & ATTR_VOLUME) && !(y[11] & ATTR_DIR);
+
+	if (bx != by) return by - bx;
+	if (vx != vy) return vy - vx;
+	return memcmp(x, y, 11);
+}
+
+static int movable(const unsigned char *e)
+{
+	return !(e[11] & (ATTR_DIR | ATTR_VOLUME)) && (le16(e + 26) >= 2);
+}
+
+/******************************************************************************/
+// first free run of (need) clusters, or the longest one
+static unsigned long freeRun(const unsigned short *ft, unsigned long need, unsigned long *len)
+{
+	unsigned long c, run = 0, best = 0;
+
+	*len = 0;
+	for (c = 2; c < clusterNum; c++) {
+		if (ft[c] == 0) {
+			if (++run == need) {
+				*len = need;
+				return c - need + 1;
+			}
+			if (run > *len) {
+				*len = run;
+				best = c - run + 1;
+			}
+		} else run = 0;
+	}
+	return best;
+}
+
+/******************************************************************************/
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: sdopt [-n] card.img|/dev/sdX\n"
+		"  rewrites a FAT16 card for SDISK II: compacted and sorted root\n"
+		"  directory (BTF first), contiguous root files\n"
+		"  -n  only print the before/after estimate, write nothing\n"
+		"back up the card first: an interrupted run leaves it inconsistent\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *root, *newRoot;
+	unsigned short *newFat;
+	unsigned long long adr;
+	unsigned long c, k, len, need, prev, moved = 0, csize;
+	cost_t before, after;
+	int dry = 0, i, opt;
+
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		if (opt == 'n') dry = 1; else usage();
+	}
+	if (optind != argc - 1) usage();
+	if ((fd = open(argv[optind], dry ? O_RDONLY : O_RDWR)) < 0) {
+		perror(argv[optind]);
+		return 2;
+	}
+
+	readVolume();
+	csize = (unsigned long)spc * 512;
+	root = malloc(rootEnts * 32);
+	readRoot(root);
+	estimate(root, fat, &before);
+
+	// new FAT: every root file released, subdirectories kept
+	newFat = malloc((size_t)fatSz * 512);
+	memcpy(newFat, fat, (size_t)fatSz * 512);
+	for (i = 0; i < entNum; i++) {
+		unsigned char *e = ents[i].e;
+		if (!movable(e)) continue;
+		for (c = le16(e + 26), k = 0; (c >= 2) && (c < clusterNum) && !pinned[c] && (k < clusterNum); k++) {
+			prev = c;
+			c = fat[c];
+			newFat[prev] = 0;
+		}
+		ents[i].clusters = k;
+	}
+
+	// new root order, then contiguous runs in that order
+	qsort(ents, entNum, sizeof(entry_t), cmpEnt);
+	for (i = 0; i < entNum; i++) {
+		unsigned char *e = ents[i].e;
+		unsigned long first = 0, old = le16(e + 26), same = 1;
+
+		if (!movable(e) || !ents[i].clusters) continue;
+		prev = 0;
+		for (need = ents[i].clusters; need; need -= len) {
+			c = freeRun(newFat, need, &len);
+			if (!c) {
+				fprintf(stderr, "out of clusters\n");
+				return 2;
+			}
+			for (k = 0; k < len; k++, c++) {
+				if (prev) newFat[prev] = c; else first = c;
+				prev = c;
+			}
+			newFat[prev] = 0xffff;
+		}
+		// read the data now, it is written once every file has a place
+		for (c = old, k = first; k >= 2 && k < 0xfff7; c = fat[c], k = newFat[k])
+			if (c != k) same = 0;
+		if (!same) {
+			ents[i].data = malloc(ents[i].clusters * csize);
+			for (c = old, k = 0; k < ents[i].clusters; c = fat[c], k++)
+				rd(clusterAddr(c), ents[i].data + k * csize, csize);
+			moved++;
+		}
+		e[26] = first & 0xff;
+		e[27] = first >> 8;
+	}
+
+	newRoot = calloc(rootEnts, 32);
+	for (i = 0; i < entNum; i++) memcpy(newRoot + i * 32, ents[i].e, 32);
+	estimate(newRoot, newFat, &after);
+
+	printf("SD commands per mount (estimate)  before    after\n");
+	printf("  mount, no EEPROM cache        %8lu %8lu\n", before.mount, after.mount);
+	printf("  chooser list and sort         %8lu %8lu\n", before.list, after.list);
+	printf("  FAT walks reading the image   %8lu %8lu\n", before.seek, after.seek);
+	printf("root entries in use             %8lu %8lu\n", before.entries, after.entries);
+	printf("fragmented root files           %8lu %8lu\n", before.fragmented, after.fragmented);
+	printf("%lu files to move\n", moved);
+	if (dry) return 0;
+
+	// data, then both FATs, then the root directory
+	for (i = 0; i < entNum; i++) {
+		if (!ents[i].data) continue;
+		for (c = le16(ents[i].e + 26), k = 0; k < ents[i].clusters; c = newFat[c], k++)
+			wr(clusterAddr(c), ents[i].data + k * csize, csize);
+	}
+	for (adr = fatAddr, k = 0; k < nFats; k++, adr += (unsigned long long)fatSz * 512)
+		wr(adr, newFat, (size_t)fatSz * 512);
+	wr(rootAddr, newRoot, rootEnts * 32);
+	if (fsync(fd) != 0) perror("fsync");
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*------------------------------------
+
+	trcstat - SD access trace analyzer for SDISK II
+
+	Reads the SDISK2.TRC trace a TRACE build of the firmware writes
+	on the card, prints what happened (seeks, sectors streamed, write
+	captures, journal hits and flushes, FAT walks, stalls), then
+	replays it against other journal and cluster map policies and
+	reports their expected hit rates and stall times.
+
+------------------------------------*/
+
+/*
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+// the firmware's journal (JRN_NUM) and cluster map window (FAT_NIC_ELEMS)
+#define FW_JRN_NUM		3
+#define FW_FAT_ELEMS	35
+
+#define MAX_JRN			8
+
+// journal policies
+enum { EAGER, LAZY, MERGE, POLICIES };
+static const char *policyName[POLICIES] = {
+	"eager (one write per sector)",
+	"lazy (write when full)",
+	"lazy, merge rewrites"
+};
+static const int jrnSizes[] = { 1, 2, 3, 4, 6, 8 };
+#define JRN_SIZES (int)(sizeof(jrnSizes) / sizeof(jrnSizes[0]))
+static const int fatWindows[] = { 8, 18, 35, 70, 140 };
+#define FAT_WINDOWS (int)(sizeof(fatWindows) / sizeof(fatWindows[0]))
+
+// a simulated journal
+typedef struct {
+	int size, policy;
+	int num;
+	unsigned char sec[MAX_JRN], trk[MAX_JRN];
+	unsigned long hits, fgWrites, idleWrites, merged;
+} jrn_t;
+
+// a simulated cluster map window
+typedef struct {
+	int elems;
+	int window;
+	unsigned long walks, reads;
+} fatw_t;
+
+static double writeMs = 2.0;		// time of a block write
+static double readMs = 0.1;			// time of a FAT entry read
+static int dump;
+
+static jrn_t jrn[POLICIES][JRN_SIZES];
+static fatw_t fatw[FAT_WINDOWS];
+static int contig = 1, spc2;
+
+/******************************************************************************/
+static int jrnFind(const jrn_t *j, int sec, int trk)
+{
+	int i;
+
+	for (i = 0; i < j->num; i++)
+		if ((j->sec[i] == sec) && (j->trk[i] == trk)) return i;
+	return -1;
+}
+
+static void jrnPop(jrn_t *j)
+{
+	memmove(j->sec, j->sec + 1, j->num - 1);
+	memmove(j->trk, j->trk + 1, j->num - 1);
+	j->num--;
+}
+
+// a data field was captured
+static void jrnWrite(jrn_t *j, int sec, int trk)
+{
+	if ((j->policy == MERGE) && (jrnFind(j, sec, trk) >= 0)) {
+		j->merged++;
+		return;
+	}
+	if (j->num == j->size) {
+		jrnPop(j);
+		j->fgWrites++;
+	}
+	j->sec[j->num] = sec;
+	j->trk[j->num] = trk;
+	j->num++;
+}
+
+// a sector is about to be streamed
+static void jrnStream(jrn_t *j, int sec, int trk)
+{
+	if (jrnFind(j, sec, trk) >= 0) {
+		j->hits++;
+		j->fgWrites += j->num;
+		j->num = 0;
+	} else if ((j->policy == EAGER) && j->num) {
+		jrnPop(j);
+		j->fgWrites++;
+	}
+}
+
+// the drive was disabled: everything is written while idle
+static void jrnIdle(jrn_t *j)
+{
+	j->idleWrites += j->num;
+	j->num = 0;
+}
+
+// block (blk) of a fragmented image is read or written
+static void fatAccess(int blk)
+{
+	int i, w;
+
+	if (contig) return;
+	for (i = 0; i < FAT_WINDOWS; i++) {
+		w = (blk >> spc2) / fatWindows[i];
+		if (w != fatw[i].window) {
+			fatw[i].window = w;
+			fatw[i].walks++;
+			fatw[i].reads += 1 + (unsigned long)(w + 1) * fatWindows[i];
+		}
+	}
+}
+
+static void simReset(void)
+{
+	int p, i;
+
+	for (p = 0; p < POLICIES; p++)
+		for (i = 0; i < JRN_SIZES; i++) {
+			jrnIdle(&jrn[p][i]);
+			jrn[p][i].size = jrnSizes[i];
+			jrn[p][i].policy = p;
+		}
+	for (i = 0; i < FAT_WINDOWS; i++) {
+		fatw[i].elems = fatWindows[i];
+		fatw[i].window = -1;
+	}
+}
+
+/******************************************************************************/
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: trcstat [-d] [-w ms] [-r ms] SDISK2.TRC ...\n"
+		"  analyzes the SD access trace of a TRACE firmware build and\n"
+		"  replays it against other journal and cluster map policies\n"
+		"  -d       dump every record\n"
+		"  -w ms    time of a block write (default 2.0)\n"
+		"  -r ms    time of a FAT entry read (default 0.1)\n");
+	exit(2);
+}
+
+static int analyze(const char *path)
+{
+	static const char *typeName[] = {
+		"end", "mount", "seek", "write", "hit", "flush",
+		"fat", "stall", "miss", "idle", "lost", "same" };
+	static const unsigned int stallMax[] = { 2, 5, 10, 20, 50, 0 };
+	FILE *fp = fopen(path, "rb");
+	unsigned char r[TRC_REC];
+	unsigned long recs = 0, cnt[TRC_SAME + 1], streamed = 0, lost = 0, mounts = 0;
+	unsigned long stallHist[6], stallTicks = 0, stallMaxTicks = 0;
+	int trk = 0, sec = 15, p, i, k;
+	unsigned int t;
+
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+	memset(cnt, 0, sizeof(cnt));
+	memset(stallHist, 0, sizeof(stallHist));
+	memset(jrn, 0, sizeof(jrn));
+	memset(fatw, 0, sizeof(fatw));
+	simReset();
+
+	while (fread(r, 1, TRC_REC, fp) == TRC_REC) {
+		if (r[0] == 0) break;
+		recs++;
+		// the sectors streamed since the previous record
+		for (k = 0; k < r[3]; k++) {
+			sec = (sec + 1) & 15;
+			for (p = 0; p < POLICIES; p++)
+				for (i = 0; i < JRN_SIZES; i++)
+					jrnStream(&jrn[p][i], sec, trk);
+			fatAccess(trk * 16 + sec);
+		}
+		streamed += r[3];
+		if (r[0] <= TRC_SAME) cnt[r[0]]++;
+		if (dump)
+			printf("%8lu %-6s %3u %3u  +%u\n", recs,
+				(r[0] <= TRC_SAME) ? typeName[r[0]] : "?", r[1], r[2], r[3]);
+
+		switch (r[0]) {
+		case TRC_MOUNT:
+			mounts++;
+			simReset();
+			contig = (r[1] & 0x80) != 0;
+			spc2 = r[2];
+			break;
+		case TRC_SEEK:
+			trk = r[1];
+			break;
+		case TRC_WRITE:
+			// the firmware streams the sector after the captured one next
+			sec = ((r[1] == 15) || (r[1] == 13)) ? r[1] + 1 : r[1];
+			trk = r[2];
+			for (p = 0; p < POLICIES; p++)
+				for (i = 0; i < JRN_SIZES; i++)
+					jrnWrite(&jrn[p][i], r[1], r[2]);
+			break;
+		case TRC_SAME:
+			// dropped before the journal, the head moves on as after a write
+			sec = ((r[1] == 15) || (r[1] == 13)) ? r[1] + 1 : r[1];
+			trk = r[2];
+			break;
+		case TRC_HIT:
+			// recorded before the sector is streamed
+			sec = (r[1] - 1) & 15;
+			trk = r[2];
+			break;
+		case TRC_FLUSH:
+			fatAccess(r[2] * 16 + r[1]);
+			break;
+		case TRC_STALL:
+			t = r[1] + r[2] * 256;
+			stallTicks += t;
+			if (t > stallMaxTicks) stallMaxTicks = t;
+			for (k = 0; stallMax[k] && (t * (double)TRC_TICK_NS / 1e6 >= stallMax[k]); k++) ;
+			stallHist[k]++;
+			break;
+		case TRC_IDLE:
+			for (p = 0; p < POLICIES; p++)
+				for (i = 0; i < JRN_SIZES; i++)
+					jrnIdle(&jrn[p][i]);
+			break;
+		case TRC_LOST:
+			lost += r[1];
+			break;
+		}
+	}
+	fclose(fp);
+
+	printf("%s: %lu records, %lu mounts, %lu lost\n", path, recs, mounts, lost);
+	printf("  sectors streamed  %lu, seeks %lu, misses %lu\n", streamed, cnt[TRC_SEEK], cnt[TRC_MISS]);
+	printf("  write captures    %lu, journal hits %lu (%.1f%% of streamed sectors)\n",
+		cnt[TRC_WRITE], cnt[TRC_HIT], streamed ? 100.0 * cnt[TRC_HIT] / streamed : 0.0);
+	printf("  unchanged         %lu captures dropped, the card had them\n", cnt[TRC_SAME]);
+	printf("  blocks written    %lu, idle times %lu\n", cnt[TRC_FLUSH], cnt[TRC_IDLE]);
+	printf("  FAT walks         %lu\n", cnt[TRC_FAT]);
+	printf("  stalls (> %.1f ms) %lu, total %.1f ms, longest %.1f ms\n",
+		TRC_SLOW * TRC_TICK_NS / 1e6, cnt[TRC_STALL],
+		stallTicks * (double)TRC_TICK_NS / 1e6, stallMaxTicks * (double)TRC_TICK_NS / 1e6);
+	if (cnt[TRC_STALL]) {
+		printf("   ");
+		for (k = 0; k < 6; k++) {
+			if (stallMax[k]) printf(" <%ums: %lu", stallMax[k], stallHist[k]);
+			else printf(" more: %lu", stallHist[k]);
+		}
+		printf("\n");
+	}
+
+	printf("\n  journal replay (firmware: eager, %d sectors), %.1f ms per write\n", FW_JRN_NUM, writeMs);
+	printf("  %-30s %4s %8s %10s %10s %12s\n", "policy", "size", "hits", "fg writes", "idle", "stall ms");
+	for (p = 0; p < POLICIES; p++)
+		for (i = 0; i < JRN_SIZES; i++) {
+			jrn_t *j = &jrn[p][i];
+
+			printf("  %-30s %4d %8lu %10lu %10lu %12.1f%s\n",
+				i ? "" : policyName[p], j->size, j->hits, j->fgWrites,
+				j->idleWrites + j->num, j->fgWrites * writeMs,
+				((p == EAGER) && (j->size == FW_JRN_NUM)) ? "  <-" : "");
+		}
+
+	printf("\n  cluster map replay (firmware: %d clusters), %.2f ms per FAT read\n", FW_FAT_ELEMS, readMs);
+	if (contig)
+		printf("  contiguous image: no FAT walks\n");
+	else {
+		printf("  %-30s %8s %10s %12s\n", "window", "walks", "FAT reads", "stall ms");
+		for (i = 0; i < FAT_WINDOWS; i++)
+			printf("  %-30d %8lu %10lu %12.1f%s\n", fatw[i].elems, fatw[i].walks,
+				fatw[i].reads, fatw[i].reads * readMs,
+				(fatw[i].elems == FW_FAT_ELEMS) ? "  <-" : "");
+		printf("  (the window costs 2 bytes of SRAM per cluster)\n");
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "dw:r:")) != -1) {
+		switch (c) {
+		case 'd': dump = 1; break;
+		case 'w': writeMs = atof(optarg); break;
+		case 'r': readMs = atof(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind >= argc) usage();
+	for (i = optind; i < argc; i++) {
+		if (i > optind) printf("\n");
+		ret |= analyze(argv[i]);
+	}
+	return ret;
+}